@@ -8,10 +8,13 @@
  *  @brief Nordic UART Service Client sample
  */
 #include "uart_async_adapter.h"//WRC
+#include "peer_table.h"
+#include "uart_frame.h"
 #include <zephyr/usb/usb_device.h> //WRC
 #include <errno.h> 
 #include <zephyr/kernel.h>
 #include <zephyr/sys/byteorder.h> 
+#include <zephyr/sys/ring_buffer.h>
 #include <zephyr/sys/printk.h> 
 
 #include <zephyr/device.h>
@@ -32,6 +35,7 @@
 #include <bluetooth/conn_ctx.h> 
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
 
 #include <zephyr/settings/settings.h>
 
@@ -43,534 +47,2746 @@
 LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 
 /* UART payload buffer element size. */
-#define UART_BUF_SIZE 20
+#define UART_BUF_SIZE CONFIG_BT_NUS_UART_BUFFER_SIZE
 
 #define KEY_PASSKEY_ACCEPT DK_BTN1_MSK
 #define KEY_PASSKEY_REJECT DK_BTN2_MSK
 
-#define NUS_WRITE_TIMEOUT K_MSEC(500)
+#define NUS_SENDER_PRIORITY 7
 #define UART_WAIT_FOR_BUF_DELAY K_MSEC(50)
 #define UART_RX_TIMEOUT 50
 
-static const struct device *uart = DEVICE_DT_GET(DT_CHOSEN(nordic_nus_uart));
-static struct k_work_delayable uart_work; 
-
-K_SEM_DEFINE(nus_write_sem, 0, 1);
+/* ATT write header (opcode and attribute handle) carried in each MTU */
+#define NUS_ATT_WRITE_HEADER_LEN 3
 
 struct uart_data_t {
 	void *fifo_reserved;
 	uint8_t  data[UART_BUF_SIZE];
+	/* The payload is data[off..off + len), a stripped header stays in place */
+	uint16_t off;
 	uint16_t len;
+	/* Number of holders, see uart_data_ref() */
+	atomic_t ref;
+	/* A framed message from the host and its destination */
+	bool framed;
+	uint8_t dest;
+	/* A broadcast, the number of peers that still have to send it, and
+	 * when it was queued, see uart_data_bcast_done(). The peers still
+	 * waiting and those that did not get it are kept by ID, a peer context
+	 * may be gone when it is reported.
+	 */
+	bool bcast;
+	atomic_t bcast_pending;
+	atomic_t bcast_reported;
+	int64_t bcast_start;
+	ATOMIC_DEFINE(bcast_waiting, PEER_TABLE_SIZE);
+	ATOMIC_DEFINE(bcast_failed, PEER_TABLE_SIZE);
 };
+
+/* Fixed-block pool for the UART and BLE payload buffers. Allocation and
+ * release are O(1) and can be done from the UART interrupt context.
+ * The buffers are reference counted: one payload can wait in several peer
+ * TX queues and the UART TX queue at once without being copied. A shared
+ * buffer must not be modified, and it can only be in one k_fifo at a time.
+ */
+K_MEM_SLAB_DEFINE_STATIC(uart_data_slab, sizeof(struct uart_data_t),
+			 CONFIG_BT_NUS_UART_DATA_POOL_SIZE, 4);
+
+static atomic_t uart_data_max_used;
+static atomic_t uart_data_alloc_failures;
+
+static struct k_work_delayable stats_work;
+
+/* Buffers handed to the UART drivers. Reception runs continuously across
+ * them and lines are framed in software, see uart_rx_frame().
+ */
+#define UART_RX_BUF_COUNT 3
+
+/*	Host ports: the UARTs in the nus-uarts property of the zephyr,user
+*	node, or only the nordic,nus-uart chosen UART. Each port has its own
+*	RX and TX pipeline and router thread and serves its own set of peers,
+*	see host_port_of(). nus-uart-first-peer gives the first peer ID of each
+*	port, for example:
+*
+*	zephyr,user {
+*		nus-uarts = <&cdc_acm_uart0 &cdc_acm_uart1>;
+*		nus-uart-first-peer = <0 10>;
+*	};
+*/
+#define ZEPHYR_USER_NODE DT_PATH(zephyr_user)
+
+#if DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, nus_uarts)
+#define HOST_PORT_COUNT DT_PROP_LEN(ZEPHYR_USER_NODE, nus_uarts)
+#define HOST_PORT_PHANDLE(node, prop, idx, fn) fn(idx, DT_PHANDLE_BY_IDX(node, prop, idx))
+#define HOST_PORT_FOREACH(fn) \
+	DT_FOREACH_PROP_ELEM_VARGS(ZEPHYR_USER_NODE, nus_uarts, HOST_PORT_PHANDLE, fn)
+#else
+#define HOST_PORT_COUNT 1
+#define HOST_PORT_FOREACH(fn) fn(0, DT_CHOSEN(nordic_nus_uart))
+#endif
+
+K_MEM_SLAB_DEFINE_STATIC(uart_rx_slab, CONFIG_BT_NUS_UART_RX_BUF_SIZE,
+			 UART_RX_BUF_COUNT * HOST_PORT_COUNT, 4);
 //WRC
 #if CONFIG_BT_NUS_UART_ASYNC_ADAPTER
-UART_ASYNC_ADAPTER_INST_DEFINE(async_adapter);
-#else
-static const struct device *const async_adapter;
+#define HOST_PORT_ADAPTER_DEFINE(idx, uart_node) \
+	UART_ASYNC_ADAPTER_INST_DEFINE(async_adapter_##idx);
+#define HOST_PORT_ADAPTER(idx, uart_node) async_adapter_##idx,
+
+HOST_PORT_FOREACH(HOST_PORT_ADAPTER_DEFINE)
 #endif
 
-static K_FIFO_DEFINE(fifo_uart_tx_data);
-static K_FIFO_DEFINE(fifo_uart_rx_data);
+/* Transfers handed to a UART at a time. The async adapter chains the
+ * second one behind the first with no gap on the line, drivers without a
+ * TX queue refuse it with -EBUSY and send one transfer at a time.
+ */
+#define UART_TX_TRANSFERS 2
 
-static struct bt_conn *default_conn;
+/* Source of output in a UART TX ring, see host_port */
+#define UART_TX_SRC_NONE 0xFF
 
-BT_CONN_CTX_DEF(conns, CONFIG_BT_MAX_CONN, sizeof(struct bt_nus_client));
+struct uart_tx_src {
+	/* Bytes not known to be sent yet */
+	uint32_t len;
+	/* Position in the port's output after the last of them */
+	uint32_t end;
+};
+
+/* Global watermarks of the UART output for the flow control to the peers */
+#define UART_TX_RING_HIGH_WATERMARK (CONFIG_BT_NUS_UART_TX_RING_SIZE * 3 / 4)
+#define UART_TX_RING_LOW_WATERMARK (CONFIG_BT_NUS_UART_TX_RING_SIZE / 4)
+
+/* XON/XOFF characters sent to the peers */
+#define NUS_FLOW_XON 0x11
+#define NUS_FLOW_XOFF 0x13
+
+BUILD_ASSERT(CONFIG_BT_NUS_PEER_FLOW_LOW_WATERMARK <
+	     CONFIG_BT_NUS_PEER_FLOW_HIGH_WATERMARK,
+	     "The peer flow control low watermark must be below the high watermark");
 
-static bool routedMessage = false;
-static bool messageStart = true;
+BUILD_ASSERT(CONFIG_BT_NUS_UART_RX_LOW_WATERMARK <
+	     CONFIG_BT_NUS_UART_RX_HIGH_WATERMARK,
+	     "The UART RX low watermark must be below the high watermark");
+
+static struct bt_conn *default_conn;
+
+/* Peers connected and still being set up, and peers ready for routing.
+ * They change in the Bluetooth thread and in the discovery work on the
+ * system workqueue, see peer_setup_end(), and scan_resume() reads them.
+ */
+static atomic_t peers_in_setup;
+static atomic_t peers_ready;
+/* Start of the current bring-up of the network, for the time-to-ready report */
+static int64_t bringup_start;
 
 #define ROUTED_MESSAGE_CHAR '*'
 #define BROADCAST_INDEX 99
+/* Messages to this ID are commands for the central, see central_command() */
+#define CENTRAL_INDEX 98
+/* Destination of data that is not routed to a peer */
+#define ROUTE_DEST_NONE (-1)
 
-static void ble_data_sent(struct bt_nus_client *nus,uint8_t err, const uint8_t *const data, uint16_t len)
+/* Routing state of one input stream: a host UART or a peer connection.
+ * Each stream has its own, so streams are parsed and routed concurrently.
+ */
+struct route_parser {
+	/* Destination of messages without a valid routing header */
+	int default_dest;
+	/* Destination of the message in progress */
+	int dest;
+	/* A message is in progress, the next data is not a header */
+	bool in_message;
+};
+
+/* A host UART with its own pipelines, so one saturated port does not hold
+ * back the peers of the others.
+ */
+struct host_port {
+	const struct device *uart;
+	uint8_t index;
+	/* The UART is driven through the async adapter */
+	bool adapted;
+	/* Restarts reception that could not get a buffer */
+	struct k_work_delayable rx_work;
+
+	/* Output. Pending output is written with one transfer per contiguous
+	 * part of the ring, so the peers' data is coalesced into large
+	 * transfers instead of one per message.
+	 */
+	struct ring_buf tx_ring;
+	uint8_t tx_ring_buf[CONFIG_BT_NUS_UART_TX_RING_SIZE];
+	struct k_spinlock tx_lock;
+	/* Lengths of the transfers in progress, oldest first */
+	uint32_t tx_active[UART_TX_TRANSFERS];
+	uint8_t tx_active_count;
+	atomic_t tx_drops;
+	/* Output of each peer in the ring by its ID, and the positions of
+	 * the output put in the ring and sent since start, so the backlog of
+	 * each peer is known as the UART sends it. Only kept for the flow
+	 * control to the peers. Protected by tx_lock.
+	 */
+	struct uart_tx_src tx_srcs[PEER_TABLE_SIZE];
+	uint32_t tx_src_put;
+	uint32_t tx_src_sent;
+	/* Source of the last output in the ring, protected by tx_lock */
+	uint8_t tx_last_src;
+
+	/* Input messages waiting for the router, their number, and reception
+	 * paused for backpressure
+	 */
+	struct k_fifo rx_fifo;
+	atomic_t rx_queued;
+	atomic_t rx_paused;
+	/* The host is held back while reception is paused: RTS is wired, or
+	 * the port is a CDC ACM UART. Without it, input past the high
+	 * watermark is dropped and counted.
+	 */
+	bool rx_flow_ctrl;
+	atomic_t rx_drops;
+	struct k_work flow_work;
+	/* Message being received, and the framing state of the input */
+	struct uart_data_t *rx_line;
+	bool rx_continued;
+	/* The last message ended with CR, a LF right after it is dropped */
+	bool rx_cr;
+	struct uart_frame_decoder rx_dec;
+	/* Routing state of the input, messages without a header are broadcast */
+	struct route_parser route;
+	/* Wakes up the router when a peer queue has room again */
+	struct k_sem tx_space;
+
+	/* Routed peer-to-peer traffic of the port's peers is also written */
+	atomic_t mirror;
+	/* The port carries COBS frames instead of text lines, see uart_frame.h */
+	atomic_t framing;
+	/* Lines written to the port start with the "*NN" ID of their source */
+	atomic_t tag;
+};
+
+#define HOST_PORT_INIT(idx, uart_node)					\
+	{								\
+		.uart = DEVICE_DT_GET(uart_node),			\
+		.index = idx,						\
+		.rx_flow_ctrl = DT_PROP(uart_node, hw_flow_control) ||	\
+			DT_NODE_HAS_COMPAT(uart_node, zephyr_cdc_acm_uart), \
+	},
+
+static struct host_port host_ports[HOST_PORT_COUNT] = {
+	HOST_PORT_FOREACH(HOST_PORT_INIT)
+};
+
+#if DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, nus_uart_first_peer)
+static const uint8_t host_port_first_peer[] =
+	DT_PROP(ZEPHYR_USER_NODE, nus_uart_first_peer);
+
+BUILD_ASSERT(ARRAY_SIZE(host_port_first_peer) == HOST_PORT_COUNT,
+	     "nus-uart-first-peer needs one entry per host port");
+#endif
+
+/* Host port serving each peer ID */
+static atomic_t peer_ports[PEER_TABLE_SIZE];
+
+#if HOST_PORT_COUNT > 1
+/* The main thread routes the first port, the others have their own */
+static K_THREAD_STACK_ARRAY_DEFINE(host_router_stacks, HOST_PORT_COUNT - 1,
+				   CONFIG_BT_NUS_THREAD_STACK_SIZE);
+static struct k_thread host_router_threads[HOST_PORT_COUNT - 1];
+#endif
+
+/*	Lifecycle of the connection of a peer. A peer is set up in this order,
+*	SECURING only for a bonded peer when CONFIG_BT_NUS_SECURITY_ENABLED is
+*	set, and only a READY peer takes data.
+*/
+enum nus_peer_state {
+	/* No connection with this ID */
+	NUS_PEER_DISCONNECTED,
+	/* Connected, the context is being set up */
+	NUS_PEER_CONNECTING,
+	/* Encrypting the link with the keys of the bond */
+	NUS_PEER_SECURING,
+	/* Negotiating the ATT MTU and the data length */
+	NUS_PEER_MTU_EXCHANGE,
+	/* Finding the NUS handles, or subscribing with the cached ones */
+	NUS_PEER_DISCOVERING,
+	NUS_PEER_READY,
+	/* Being disconnected, or torn down after the disconnection */
+	NUS_PEER_DISCONNECTING,
+};
+
+static const char *const nus_peer_state_names[] = {
+	[NUS_PEER_DISCONNECTED] = "disconnected",
+	[NUS_PEER_CONNECTING] = "connecting",
+	[NUS_PEER_SECURING] = "securing",
+	[NUS_PEER_MTU_EXCHANGE] = "MTU exchange",
+	[NUS_PEER_DISCOVERING] = "discovering",
+	[NUS_PEER_READY] = "ready",
+	[NUS_PEER_DISCONNECTING] = "disconnecting",
+};
+
+/* A broadcast issued to a peer, with its writes on the link */
+struct nus_bcast_mark {
+	struct uart_data_t *buf;
+	atomic_val_t first;
+	atomic_val_t last;
+	bool failed;
+};
+
+enum db_hash_state {
+	/* Not read yet on this connection */
+	DB_HASH_UNREAD,
+	DB_HASH_READING,
+	DB_HASH_VALID,
+	/* The server has no Database Hash, its handles are not cached */
+	DB_HASH_NONE,
+};
+
+/* State of each peer ID, read without a lock by the routers */
+static atomic_t peer_states[PEER_TABLE_SIZE];
+
+/* Per-connection context kept in the connection context library */
+struct nus_peer {
+	struct bt_nus_client client;
+	/* Stable routing ID from the peer table */
+	uint8_t id;
+	/* Routing state of the data received from this peer */
+	struct route_parser route;
+	/* The next data written to the UART starts a new line */
+	bool uart_line_start;
+	struct bt_gatt_exchange_params mtu_params;
+	/* Negotiated ATT MTU, 0 until the MTU exchange has finished */
+	uint16_t mtu;
+	/* Link layer data length (LE Data Length Extension) */
+	uint16_t tx_octets;
+	uint16_t tx_time;
+	uint16_t rx_octets;
+	uint16_t rx_time;
+	/* The data length update was requested, its result is awaited */
+	atomic_t data_len_pending;
+	/* Credits for the GATT writes that can be in flight on this link */
+	struct k_sem tx_credits;
+	/* Credits handed out on this link, and those to drop when returned */
+	uint8_t tx_credit_limit;
+	atomic_t tx_credits_retired;
+	/* Writes issued and completed on this link, they complete in order */
+	atomic_t tx_issued;
+	atomic_t tx_done;
+	/* Broadcasts issued on this link and waiting for their last write to
+	 * complete, oldest first, and the first write and the write errors of
+	 * the message being issued. Protected by bcast_lock.
+	 */
+	struct k_spinlock bcast_lock;
+	struct nus_bcast_mark bcast_marks[CONFIG_BT_NUS_TX_CREDITS];
+	uint8_t bcast_mark_head;
+	uint8_t bcast_mark_count;
+	atomic_val_t tx_head_first;
+	bool tx_head_failed;
+	/* The NUS RX characteristic accepts Write Without Response */
+	bool write_cmd;
+	/* Database Hash of the server, read before the cached handles are used */
+	struct bt_gatt_read_params db_hash_read;
+	enum db_hash_state db_hash_state;
+	uint8_t db_hash[PEER_TABLE_DB_HASH_LEN];
+	/* Messages routed to this peer, drained by the sender thread */
+	struct k_msgq tx_queue;
+	char __aligned(4) tx_queue_buf[CONFIG_BT_NUS_PEER_TX_QUEUE_SIZE *
+				       sizeof(struct uart_data_t *)];
+	/* Message being written and how much of it was issued */
+	struct uart_data_t *tx_head;
+	uint16_t tx_pos;
+	/* Messages dropped because the queue was full */
+	atomic_t tx_drops;
+	/* XOFF is wanted for this peer, and the state last sent to it */
+	atomic_t flow_xoff;
+	bool flow_xoff_sent;
+	/* Connected, but the discovery has not completed yet */
+	bool in_setup;
+	/* Counted in peers_ready */
+	bool ready;
+	/* Uptime when the peer connected */
+	int64_t connected_at;
+};
+
+BT_CONN_CTX_DEF(conns, CONFIG_BT_MAX_CONN, sizeof(struct nus_peer));
+
+/* Cheap enough for any thread, and for a hot path */
+static enum nus_peer_state nus_peer_state_get(uint8_t id)
 {
+	if (id >= PEER_TABLE_SIZE) {
+		return NUS_PEER_DISCONNECTED;
+	}
 
-	k_sem_give(&nus_write_sem);
+	return atomic_get(&peer_states[id]);
+}
 
-	if (err) {
-		LOG_WRN("ATT error code: 0x%02X", err);
+static void nus_peer_state_set(const struct nus_peer *peer,
+			       enum nus_peer_state state)
+{
+	enum nus_peer_state old = atomic_set(&peer_states[peer->id], state);
+
+	if (old != state) {
+		LOG_INF("Server %d: %s -> %s", peer->id,
+			nus_peer_state_names[old], nus_peer_state_names[state]);
 	}
 }
 
-/*	New function for sending data into the multi-NUS
-* 	Extensions to the behavior of message routing can be made here.
-*	If the first character is *, this indicates a routed message.
-*	If the first character is not *, then this is a broadcast message sent to all peers.
-* 	If the message is routed, the two characters after the * will be read as the peer number
-*	and the message will be sent only to that peer. Numbers must be written as two digits, i.e 01 for 1.
-*	The default behavior will be to broadcast in the case of failure of message parsing.
-*/
-static int multi_nus_send(struct uart_data_t *buf){
-	
-	int err = 0;
-	char * message = buf->data;
-	int length = buf->len;
-	
-	static bool broadcast = false;
-	static int nus_index = 0;
+/* Connected peers by their stable ID, so routing is a direct index. The lock
+ * keeps a peer from being taken out while a message is queued to it.
+ */
+static struct nus_peer *routes[PEER_TABLE_SIZE];
+static K_MUTEX_DEFINE(routes_lock);
 
-	LOG_INF("Multi-Nus Send");
+/* Bytes from each peer waiting in the TX ring of its host port */
+static atomic_t uart_tx_backlog[PEER_TABLE_SIZE];
+/* Number of peers that are sent XOFF */
+static atomic_t uart_flow_xoff_peers;
 
-	/*How many connections are there in the Connection Context Library?*/
-	const size_t num_nus_conns = bt_conn_ctx_count(&conns_ctx_lib);
+/* Wakes up the sender thread when a message is queued or a credit returns */
+static K_SEM_DEFINE(nus_tx_kick, 0, 1);
 
-	/*Handle the routing of the message only at the beginning of the message*/
-	if (messageStart) {
-		messageStart = false;
+BUILD_ASSERT(PEER_TABLE_SIZE <= CENTRAL_INDEX,
+	     "Peer IDs are sent as two digits, 98 and 99 are reserved");
 
-		/*Check if it's a routed message*/
-		if (message[0] == ROUTED_MESSAGE_CHAR) {
-			
-			routedMessage = true;
-			/*Determine who the intended recipient is*/
-			char str[2];
-			str[0] = message[1];
-			str[1] = message[2];
-			nus_index = atoi(str);
+/* The host port that serves a peer: it gets the peer's output, and only
+ * its input reaches the peer.
+ */
+static struct host_port *host_port_of(uint8_t id)
+{
+	return &host_ports[atomic_get(&peer_ports[id])];
+}
 
-			/*Is this a number that makes sense?*/
-			if ((nus_index >= 0) && (nus_index < num_nus_conns)){
-				broadcast = false;
-
-				/*Move the data buffer pointer to after the recipient info and 
-				shorten the length*/
-				message =  &message[3];
-				length = length - 3;
-			} else if (nus_index == BROADCAST_INDEX) {
-				broadcast = true;
-				message =  &message[3];
-				length = length - 3;
-			}
-		} else {
-			broadcast = true;
+/* Messages from a host port only reach its peers, peers reach everyone */
+static bool host_port_serves(const struct host_port *port, uint8_t id)
+{
+	return !port || (atomic_get(&peer_ports[id]) == port->index);
+}
+
+static struct uart_data_t *uart_data_alloc(void)
+{
+	struct uart_data_t *buf;
+	atomic_val_t used;
+	atomic_val_t max_used;
+
+	if (k_mem_slab_alloc(&uart_data_slab, (void **)&buf, K_NO_WAIT)) {
+		atomic_inc(&uart_data_alloc_failures);
+		return NULL;
+	}
+
+	/* Track the high-water mark of the pool */
+	used = k_mem_slab_num_used_get(&uart_data_slab);
+	max_used = atomic_get(&uart_data_max_used);
+	while ((used > max_used) &&
+	       !atomic_cas(&uart_data_max_used, max_used, used)) {
+		max_used = atomic_get(&uart_data_max_used);
+	}
+
+	buf->off = 0;
+	buf->len = 0;
+	buf->framed = false;
+	buf->bcast = false;
+	atomic_set(&buf->ref, 1);
+
+	return buf;
+}
+
+/* Take another reference to a buffer for a new holder */
+static struct uart_data_t *uart_data_ref(struct uart_data_t *buf)
+{
+	atomic_inc(&buf->ref);
+
+	return buf;
+}
+
+/* Release a reference, the last holder returns the buffer to the pool */
+static void uart_data_unref(struct uart_data_t *buf)
+{
+	if (atomic_dec(&buf->ref) == 1) {
+		k_mem_slab_free(&uart_data_slab, buf);
+	}
+}
+
+/*	Broadcasts that some peers have not acknowledged yet, each with a
+*	reference. The watch work reports those still pending after
+*	CONFIG_BT_NUS_BROADCAST_TIMEOUT. Every entry holds a pool buffer, so
+*	the list cannot overflow.
+*/
+static struct uart_data_t *bcast_watch[CONFIG_BT_NUS_UART_DATA_POOL_SIZE];
+static size_t bcast_watch_count;
+static struct k_spinlock bcast_watch_lock;
+
+static void bcast_watch_handler(struct k_work *item);
+
+static K_WORK_DELAYABLE_DEFINE(bcast_watch_work, bcast_watch_handler);
+
+/* Report a broadcast once: when every peer is done, or at its deadline */
+static void uart_data_bcast_report(struct uart_data_t *buf)
+{
+	if (!atomic_cas(&buf->bcast_reported, 0, 1)) {
+		return;
+	}
+
+	for (int i = 0; i < PEER_TABLE_SIZE; i++) {
+		if (atomic_test_bit(buf->bcast_failed, i)) {
+			LOG_WRN("Broadcast to server %d failed", i);
+		} else if (atomic_test_bit(buf->bcast_waiting, i)) {
+			LOG_WRN("Broadcast to server %d timed out", i);
 		}
 	}
 
+	if (!atomic_get(&buf->bcast_pending)) {
+		LOG_INF("Broadcast done in %u ms",
+			(unsigned int)(k_uptime_get() - buf->bcast_start));
+	}
+}
+
+static void bcast_watch_add(struct uart_data_t *buf)
+{
+	k_spinlock_key_t key = k_spin_lock(&bcast_watch_lock);
 
+	bcast_watch[bcast_watch_count++] = uart_data_ref(buf);
 
-	/*	If it's a routed message, send it to that guy. 
-	*	If it's not, broadcast it to everyone.
-	*/
-	if (broadcast == false){
-		const struct bt_conn_ctx *ctx =
-				bt_conn_ctx_get_by_id(&conns_ctx_lib, nus_index);
-		LOG_INF("Trying to send to server %d", nus_index);
-
-		
-		if (ctx) {
-			struct bt_nus_client *nus_client = ctx->data;
-
-			if (nus_client) {
-				err = bt_nus_client_send(nus_client,
-								     message,
-								     length);
-				if (err) {
-					LOG_WRN("Failed to send data over BLE connection"
-						"(err %d)",
-						err);
-				}else{
-					LOG_INF("Sent to server %d: %s", nus_index, buf->data);
-				}
-			
-			
-				err = k_sem_take(&nus_write_sem,
-							NUS_WRITE_TIMEOUT);
-				if (err) {
-					LOG_WRN("NUS send timeout");
-				}
-			}
-			bt_conn_ctx_release(&conns_ctx_lib,
-							(void *)ctx->data);
+	k_spin_unlock(&bcast_watch_lock, key);
 
+	/* An earlier broadcast has the earlier deadline */
+	k_work_schedule(&bcast_watch_work, K_MSEC(CONFIG_BT_NUS_BROADCAST_TIMEOUT));
+}
+
+static void bcast_watch_remove(struct uart_data_t *buf)
+{
+	bool found = false;
+	k_spinlock_key_t key = k_spin_lock(&bcast_watch_lock);
+
+	for (size_t i = 0; i < bcast_watch_count; i++) {
+		if (bcast_watch[i] == buf) {
+			bcast_watch[i] = bcast_watch[--bcast_watch_count];
+			found = true;
+			break;
 		}
+	}
 
-	}else{//Broadcast message
-		LOG_INF("Broadcast");
-		for (size_t i = 0; i < num_nus_conns; i++) {
-			const struct bt_conn_ctx *ctx =
-				bt_conn_ctx_get_by_id(&conns_ctx_lib, i);
+	k_spin_unlock(&bcast_watch_lock, key);
 
-			if (ctx) {
-				struct bt_nus_client *nus_client = ctx->data;
-
-				if (nus_client != NULL) {
-					err = bt_nus_client_send(nus_client,
-								     message,
-								     length);
-					if (err) {
-						LOG_WRN("Failed to send data over BLE connection"
-							"(err %d)",
-							err);
-					}else{
-						LOG_INF("Sent to server %d: %s", nus_index, buf->data);
-					}
-
-					bt_conn_ctx_release(&conns_ctx_lib,
-							    (void *)ctx->data);
-
-					err = k_sem_take(&nus_write_sem,
-							 NUS_WRITE_TIMEOUT);
-					if (err) {
-						LOG_WRN("NUS send timeout");
-					}
-				}
+	if (found) {
+		uart_data_unref(buf);
+	}
+}
+
+static void bcast_watch_handler(struct k_work *item)
+{
+	struct uart_data_t *expired[ARRAY_SIZE(bcast_watch)];
+	size_t count = 0;
+	int64_t now = k_uptime_get();
+	int64_t next = -1;
+	k_spinlock_key_t key = k_spin_lock(&bcast_watch_lock);
+
+	for (size_t i = 0; i < bcast_watch_count;) {
+		struct uart_data_t *buf = bcast_watch[i];
+		int64_t deadline = buf->bcast_start + CONFIG_BT_NUS_BROADCAST_TIMEOUT;
+
+		if (deadline <= now) {
+			expired[count++] = buf;
+			bcast_watch[i] = bcast_watch[--bcast_watch_count];
+		} else {
+			if ((next < 0) || (deadline < next)) {
+				next = deadline;
 			}
+
+			i++;
 		}
 	}
-	if ( (message[length-1] == '\n') || (message[length-1] == '\r') ) {
-		messageStart = true;
-		routedMessage = false;
+
+	k_spin_unlock(&bcast_watch_lock, key);
+
+	for (size_t i = 0; i < count; i++) {
+		uart_data_bcast_report(expired[i]);
+		uart_data_unref(expired[i]);
 	}
 
-	return err;
+	if (next >= 0) {
+		k_work_schedule(&bcast_watch_work, K_MSEC(next - now));
+	}
 }
 
-/*	This function has been updated to add the ability for a peer to route a message by
-*	appending a '*' as in the multi-NUS send function. So a peer could send the message
-*	*00 to send a message to peer 0. If the peer sends a *99, that message is broadcast to 
-*	all peers
+/*	Peer id is done with a broadcast, sent tells if the peer acknowledged
+*	it or if it was dropped. The broadcaster holds one count of its own
+*	while it queues the message, id is then -1.
 */
+static void uart_data_bcast_done(struct uart_data_t *buf, int id, bool sent)
+{
+	if (!buf->bcast) {
+		return;
+	}
 
-static uint8_t ble_data_received(struct bt_nus_client *nus,const uint8_t *const data, uint16_t len)
+	if (id >= 0) {
+		if (!sent) {
+			atomic_set_bit(buf->bcast_failed, id);
+		}
+
+		atomic_clear_bit(buf->bcast_waiting, id);
+	}
+
+	if (atomic_dec(&buf->bcast_pending) != 1) {
+		return;
+	}
+
+	uart_data_bcast_report(buf);
+	bcast_watch_remove(buf);
+}
+
+static uint32_t uart_tx_used(struct host_port *port)
 {
-	int err;
+	k_spinlock_key_t key = k_spin_lock(&port->tx_lock);
+	uint32_t used = ring_buf_size_get(&port->tx_ring);
 
-	for (uint16_t pos = 0; pos != len;) {
-		struct uart_data_t *tx = k_malloc(sizeof(*tx));
+	k_spin_unlock(&port->tx_lock, key);
 
-		if (!tx) {
-			LOG_WRN("Not able to allocate UART send data buffer");
-			return BT_GATT_ITER_CONTINUE;
-		}
+	return used;
+}
+
+/*	Flow control towards a peer when the host UART is saturated. XOFF is
+*	sent when the peer's own output waiting for the UART passes its high
+*	watermark, or when the ring passes its global high watermark while the
+*	peer has output in it. XON is sent when both are below their low
+*	watermarks again. The sender thread sends the control character.
+*/
+static void nus_peer_flow_update(struct nus_peer *peer)
+{
+	uint32_t used = uart_tx_used(host_port_of(peer->id));
+	atomic_val_t backlog = atomic_get(&uart_tx_backlog[peer->id]);
+	bool xoff;
 
-		/* Keep the last byte of TX buffer for potential LF char. */
-		size_t tx_data_size = sizeof(tx->data) - 1;
+	if (!IS_ENABLED(CONFIG_BT_NUS_PEER_FLOW_CONTROL)) {
+		return;
+	}
+
+	if ((backlog >= CONFIG_BT_NUS_PEER_FLOW_HIGH_WATERMARK) ||
+	    (backlog && (used >= UART_TX_RING_HIGH_WATERMARK))) {
+		xoff = true;
+	} else if ((backlog <= CONFIG_BT_NUS_PEER_FLOW_LOW_WATERMARK) &&
+		   (used <= UART_TX_RING_LOW_WATERMARK)) {
+		xoff = false;
+	} else {
+		return;
+	}
 
-		if ((len - pos) > tx_data_size) {
-			tx->len = tx_data_size;
+	if (atomic_set(&peer->flow_xoff, xoff) != xoff) {
+		if (xoff) {
+			atomic_inc(&uart_flow_xoff_peers);
 		} else {
-			tx->len = (len - pos);
+			atomic_dec(&uart_flow_xoff_peers);
 		}
 
-		memcpy(tx->data, &data[pos], tx->len);
+		k_sem_give(&nus_tx_kick);
+	}
+}
 
-		pos += tx->len;
+/* Check the peers that are sent XOFF as the UART output drains */
+static void uart_flow_peer_work_handler(struct k_work *item)
+{
+	k_mutex_lock(&routes_lock, K_FOREVER);
 
-		/* Append the LF character when the CR character triggered
-		 * transmission from the peer.
-		 */
-		if ((pos == len) && (data[len - 1] == '\r')) {
-			tx->data[tx->len] = '\n';
-			tx->len++;
+	for (size_t i = 0; i < PEER_TABLE_SIZE; i++) {
+		if (routes[i] && atomic_get(&routes[i]->flow_xoff)) {
+			nus_peer_flow_update(routes[i]);
 		}
+	}
 
-		/*	Routed messages. See the comments above. 
-		*	Check for *, if there's a star, send it over to the multi-nus send function
-		*/
-		if (( data[0] == '*') || (routedMessage == true) ) {
-			multi_nus_send(tx);
-		}
+	k_mutex_unlock(&routes_lock);
+}
 
-		err = uart_tx(uart, tx->data, tx->len, SYS_FOREVER_MS);
-		if (err) {
-			k_fifo_put(&fifo_uart_tx_data, tx);
-		}
+static K_WORK_DEFINE(uart_flow_peer_work, uart_flow_peer_work_handler);
+
+/*	Account output from a source, must hold the port's tx_lock. Output is
+*	always charged to the peer it comes from, whatever the number of peers
+*	writing to the port. Output that is not from a peer only moves the
+*	position.
+*/
+static void uart_tx_src_add(struct host_port *port, uint8_t id, uint32_t len)
+{
+	port->tx_src_put += len;
+
+	if (id != UART_TX_SRC_NONE) {
+		struct uart_tx_src *src = &port->tx_srcs[id];
+
+		src->len += len;
+		src->end = port->tx_src_put;
+		atomic_add(&uart_tx_backlog[id], len);
 	}
+}
 
-	return BT_GATT_ITER_CONTINUE;
+/*	Account output that the UART has sent, must hold the port's tx_lock.
+*	The output of a peer all lies before its end position, so no more of
+*	it than the distance from the sent position to there is still in the
+*	ring. When the output of several peers is mixed, a peer's backlog is
+*	released a bit late, never early and never to another peer.
+*/
+static void uart_tx_src_consume(struct host_port *port, uint32_t len)
+{
+	port->tx_src_sent += len;
+
+	for (size_t i = 0; i < PEER_TABLE_SIZE; i++) {
+		struct uart_tx_src *src = &port->tx_srcs[i];
+		int32_t ahead = (int32_t)(src->end - port->tx_src_sent);
+		uint32_t left;
+
+		if (!src->len) {
+			continue;
+		}
+
+		left = (ahead > 0) ? MIN(src->len, (uint32_t)ahead) : 0;
+		atomic_sub(&uart_tx_backlog[i], src->len - left);
+		src->len = left;
+	}
 }
 
-static void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
+/*	Claim the output of the transfers in progress again, must hold the
+*	port's tx_lock. Finishing a claim of the ring releases all its claims.
+*/
+static void uart_tx_reclaim(struct host_port *port)
 {
-	ARG_UNUSED(dev);
+	uint32_t claimed = 0;
+	uint8_t *data;
 
-	static uint8_t *current_buf;
-	static size_t aborted_len;
-	static bool buf_release;
-	struct uart_data_t *buf;
-	static uint8_t *aborted_buf; 
+	ring_buf_get_finish(&port->tx_ring, 0);
 
-	switch (evt->type) {
-	case UART_TX_DONE:
-		if ((evt->data.tx.len == 0) ||
-		    (!evt->data.tx.buf)) {
+	for (size_t i = 0; i < port->tx_active_count; i++) {
+		claimed += port->tx_active[i];
+	}
+
+	while (claimed) {
+		claimed -= ring_buf_get_claim(&port->tx_ring, &data, claimed);
+	}
+}
+
+/* Start transfers of the pending output, must hold the port's tx_lock */
+static void uart_tx_kick(struct host_port *port)
+{
+	uint8_t *data;
+	uint32_t len;
+	int err;
+
+	while (port->tx_active_count < UART_TX_TRANSFERS) {
+		len = ring_buf_get_claim(&port->tx_ring, &data,
+					 CONFIG_BT_NUS_UART_TX_RING_SIZE);
+		if (!len) {
 			return;
 		}
 
-		if (aborted_buf) {
-			buf = CONTAINER_OF(aborted_buf, struct uart_data_t, data[0]);
-			aborted_buf = NULL;
-			aborted_len = 0;
-		} else {
-			buf = CONTAINER_OF(evt->data.tx.buf,
-					   struct uart_data_t,
-					   data[0]);
-		}
+		err = uart_tx(port->uart, data, len, SYS_FOREVER_MS);
+		if (err) {
+			uart_tx_reclaim(port);
 
-		k_free(buf);
+			/* Busy only means the UART takes no queued transfer */
+			if (!port->tx_active_count || (err != -EBUSY)) {
+				LOG_WRN("Failed to send data over UART %d",
+					port->index);
+			}
 
-		buf = k_fifo_get(&fifo_uart_tx_data, K_NO_WAIT);
-		if (!buf) {
 			return;
 		}
 
-		if (uart_tx(uart, buf->data, buf->len, SYS_FOREVER_MS)) {
-			LOG_WRN("Failed to send data over UART");
+		port->tx_active[port->tx_active_count++] = len;
+	}
+}
+
+/* Called from the UART callback when the oldest transfer has sent len bytes */
+static void uart_tx_done(struct host_port *port, uint32_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&port->tx_lock);
+
+	if (port->tx_active_count) {
+		/* The rest of an aborted transfer is sent again, unless the
+		 * next transfer is already on its way, then it is dropped.
+		 */
+		if ((len < port->tx_active[0]) && (port->tx_active_count > 1)) {
+			atomic_add(&port->tx_drops, port->tx_active[0] - len);
+			len = port->tx_active[0];
 		}
 
-		break;
+		len = MIN(len, port->tx_active[0]);
+		ring_buf_get_finish(&port->tx_ring, len);
 
-	case UART_RX_RDY:
-		buf = CONTAINER_OF(evt->data.rx.buf, struct uart_data_t, data[0]);
-		buf->len += evt->data.rx.len;
-		buf_release = false;
+		if (IS_ENABLED(CONFIG_BT_NUS_PEER_FLOW_CONTROL)) {
+			uart_tx_src_consume(port, len);
+		}
 
-		if (buf->len == UART_BUF_SIZE) {
-			k_fifo_put(&fifo_uart_rx_data, buf);
-		} else if ((evt->data.rx.buf[buf->len - 1] == '\n') ||
-			  (evt->data.rx.buf[buf->len - 1] == '\r')) {
-			k_fifo_put(&fifo_uart_rx_data, buf);
-			current_buf = evt->data.rx.buf;
-			buf_release = true;
-			uart_rx_disable(uart);
+		port->tx_active_count--;
+		for (size_t i = 0; i < port->tx_active_count; i++) {
+			port->tx_active[i] = port->tx_active[i + 1];
 		}
 
-		break;
+		uart_tx_reclaim(port);
+	}
 
-	case UART_RX_DISABLED:
-		buf = k_malloc(sizeof(*buf));
-		if (buf) {
-			buf->len = 0;
-		} else {
-			LOG_WRN("Not able to allocate UART receive buffer");
-			k_work_schedule(&uart_work,
-					      UART_WAIT_FOR_BUF_DELAY);
-			return;
-		}
+	uart_tx_kick(port);
 
-		uart_rx_enable(uart, buf->data, sizeof(buf->data),
-			       UART_RX_TIMEOUT);
+	k_spin_unlock(&port->tx_lock, key);
 
-		break;
+	if (IS_ENABLED(CONFIG_BT_NUS_PEER_FLOW_CONTROL) &&
+	    atomic_get(&uart_flow_xoff_peers)) {
+		k_work_submit(&uart_flow_peer_work);
+	}
+}
 
-	case UART_RX_BUF_REQUEST:
-		buf = k_malloc(sizeof(*buf));
-		if (buf) {
-			buf->len = 0;
-			uart_rx_buf_rsp(uart, buf->data, sizeof(buf->data));
-		} else {
-			LOG_WRN("Not able to allocate UART receive buffer");
-		}
+struct uart_tx_seg {
+	const uint8_t *data;
+	size_t len;
+};
 
-		break;
+/*	Queue output for the host UART. The segments are queued together, or
+*	dropped and counted when the ring does not have room for all of them.
+*	id is the peer the output comes from, or UART_TX_SRC_NONE.
+*	With tag_optional, segs[0] is the source tag of a line that continues,
+*	it is left out when the last output in the ring came from id as well.
+*/
+static int uart_tx_write(struct host_port *port, const struct uart_tx_seg *segs,
+			 size_t count, uint8_t id, bool tag_optional)
+{
+	size_t len = 0;
+	int err = 0;
+	k_spinlock_key_t key;
 
-	case UART_RX_BUF_RELEASED:
-		buf = CONTAINER_OF(evt->data.rx_buf.buf, struct uart_data_t,
-				   data[0]);
-		if (buf_release && (current_buf != evt->data.rx_buf.buf)) {
-			k_free(buf);
-			buf_release = false;
-			current_buf = NULL;
-		}
+	key = k_spin_lock(&port->tx_lock);
 
-		break;
+	if (tag_optional && (port->tx_last_src == id)) {
+		segs++;
+		count--;
+	}
 
-	case UART_TX_ABORTED:
-			if (!aborted_buf) {
-				aborted_buf = (uint8_t *)evt->data.tx.buf;
-			}
+	for (size_t i = 0; i < count; i++) {
+		len += segs[i].len;
+	}
+
+	if (ring_buf_space_get(&port->tx_ring) < len) {
+		err = -ENOBUFS;
+	} else {
+		if (IS_ENABLED(CONFIG_BT_NUS_PEER_FLOW_CONTROL)) {
+			uart_tx_src_add(port, id, len);
+		}
 
-			aborted_len += evt->data.tx.len;
-			buf = CONTAINER_OF(aborted_buf, struct uart_data_t,
-					   data[0]);
+		for (size_t i = 0; i < count; i++) {
+			ring_buf_put(&port->tx_ring, segs[i].data, segs[i].len);
+		}
 
-			uart_tx(uart, &buf->data[aborted_len],
-				buf->len - aborted_len, SYS_FOREVER_MS);
+		port->tx_last_src = id;
+		uart_tx_kick(port);
+	}
 
-		break;
+	k_spin_unlock(&port->tx_lock, key);
 
-	default:
-		break;
+	if (err) {
+		atomic_add(&port->tx_drops, len);
 	}
+
+	return err;
 }
 
-static void uart_work_handler(struct k_work *item)
+/*	Framed mode output: data from a peer is sent in DATA frames with the
+*	peer's ID in the address field. Only called from the Bluetooth RX
+*	thread, which owns the encoding buffer.
+*/
+static int uart_tx_frames(struct host_port *port, uint8_t id,
+			  const uint8_t *data, uint16_t len)
 {
-	struct uart_data_t *buf;
+	static uint8_t frame[UART_FRAME_ENCODED_MAX(UART_BUF_SIZE)];
+	int err = 0;
 
-	buf = k_malloc(sizeof(*buf));
-	if (buf) {
-		buf->len = 0;
-	} else {
-		LOG_WRN("Not able to allocate UART receive buffer");
-		k_work_schedule(&uart_work, UART_WAIT_FOR_BUF_DELAY);
-		return;
+	for (uint16_t pos = 0; (pos < len) && !err;) {
+		uint16_t chunk = MIN(len - pos, UART_BUF_SIZE);
+		struct uart_tx_seg seg = {
+			.data = frame,
+			.len = uart_frame_encode(UART_FRAME_DATA, id, &data[pos],
+						 chunk, frame),
+		};
+
+		err = uart_tx_write(port, &seg, 1, id, false);
+		pos += chunk;
+	}
+
+	return err;
+}
+
+static void stats_work_handler(struct k_work *item)
+{
+	LOG_INF("UART data pool: %u/%u used, peak %u, %u allocation failures",
+		k_mem_slab_num_used_get(&uart_data_slab),
+		CONFIG_BT_NUS_UART_DATA_POOL_SIZE,
+		(unsigned int)atomic_get(&uart_data_max_used),
+		(unsigned int)atomic_get(&uart_data_alloc_failures));
+
+	for (size_t i = 0; i < HOST_PORT_COUNT; i++) {
+		struct host_port *port = &host_ports[i];
+
+		LOG_INF("UART %d TX ring: %u/%u used, %u bytes dropped, "
+			"%u input bytes dropped", (int)i,
+			uart_tx_used(port), CONFIG_BT_NUS_UART_TX_RING_SIZE,
+			(unsigned int)atomic_get(&port->tx_drops),
+			(unsigned int)atomic_get(&port->rx_drops));
+
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_STATS)
+		if (port->adapted) {
+			struct uart_async_adapter_stats irq_stats;
+
+			uart_async_adapter_stats_get(port->uart, &irq_stats);
+			if (irq_stats.bytes) {
+				LOG_INF("UART %d IRQ: %u interrupts, %u bytes, %u ns/KB",
+					(int)i, irq_stats.irqs,
+					(unsigned int)irq_stats.bytes,
+					(unsigned int)(k_cyc_to_ns_floor64(irq_stats.cycles) *
+						       1024 / irq_stats.bytes));
+			}
+		}
+#endif
+	}
+
+	k_mutex_lock(&routes_lock, K_FOREVER);
+
+	for (size_t i = 0; i < PEER_TABLE_SIZE; i++) {
+		struct nus_peer *peer = routes[i];
+
+		if (peer) {
+			LOG_INF("Server %d (%s): TX queue %u/%u, %u dropped, "
+				"UART %d backlog %u bytes%s", (int)i,
+				nus_peer_state_names[nus_peer_state_get(i)],
+				k_msgq_num_used_get(&peer->tx_queue),
+				CONFIG_BT_NUS_PEER_TX_QUEUE_SIZE,
+				(unsigned int)atomic_get(&peer->tx_drops),
+				host_port_of(i)->index,
+				(unsigned int)atomic_get(&uart_tx_backlog[i]),
+				atomic_get(&peer->flow_xoff) ? ", XOFF" : "");
+		}
+	}
+
+	k_mutex_unlock(&routes_lock);
+
+	k_work_schedule(&stats_work, K_SECONDS(CONFIG_BT_NUS_STATS_INTERVAL));
+}
+
+/* Write seq of a link is at or past mark, the counters wrap around */
+static bool tx_seq_reached(atomic_val_t seq, atomic_val_t mark)
+{
+	return (int32_t)((uint32_t)seq - (uint32_t)mark) >= 0;
+}
+
+static struct nus_bcast_mark *nus_peer_bcast_mark(struct nus_peer *peer,
+						  uint8_t i)
+{
+	return &peer->bcast_marks[(peer->bcast_mark_head + i) %
+				  ARRAY_SIZE(peer->bcast_marks)];
+}
+
+/* The sender starts to issue the next message of the peer */
+static void nus_peer_tx_head_start(struct nus_peer *peer)
+{
+	k_spinlock_key_t key = k_spin_lock(&peer->bcast_lock);
+
+	peer->tx_head_first = atomic_get(&peer->tx_issued) + 1;
+	peer->tx_head_failed = false;
+
+	k_spin_unlock(&peer->bcast_lock, key);
+}
+
+/*	The sender issued all the writes of a message to the peer. A
+*	broadcast is done for this peer when the last of them completes.
+*/
+static void nus_peer_bcast_issued(struct nus_peer *peer, struct uart_data_t *buf)
+{
+	k_spinlock_key_t key;
+	atomic_val_t last;
+	bool failed;
+
+	if (!buf->bcast) {
+		return;
+	}
+
+	key = k_spin_lock(&peer->bcast_lock);
+
+	last = atomic_get(&peer->tx_issued);
+	failed = peer->tx_head_failed;
+
+	if (!tx_seq_reached(atomic_get(&peer->tx_done), last) &&
+	    (peer->bcast_mark_count < ARRAY_SIZE(peer->bcast_marks))) {
+		struct nus_bcast_mark *mark =
+			nus_peer_bcast_mark(peer, peer->bcast_mark_count);
+
+		mark->buf = uart_data_ref(buf);
+		mark->first = peer->tx_head_first;
+		mark->last = last;
+		mark->failed = failed;
+		peer->bcast_mark_count++;
+		buf = NULL;
+	}
+
+	k_spin_unlock(&peer->bcast_lock, key);
+
+	if (buf) {
+		uart_data_bcast_done(buf, peer->id, !failed);
+	}
+}
+
+/*	A write completed on the link, err is the ATT error. The error goes to
+*	the broadcast the write belongs to, and the broadcasts whose last write
+*	it was are done for this peer.
+*/
+static void nus_peer_bcast_acked(struct nus_peer *peer, uint8_t err)
+{
+	struct nus_bcast_mark done[ARRAY_SIZE(peer->bcast_marks)];
+	size_t count = 0;
+	k_spinlock_key_t key = k_spin_lock(&peer->bcast_lock);
+	atomic_val_t seq = atomic_inc(&peer->tx_done) + 1;
+	bool found = false;
+
+	for (uint8_t i = 0; err && (i < peer->bcast_mark_count); i++) {
+		struct nus_bcast_mark *mark = nus_peer_bcast_mark(peer, i);
+
+		if (tx_seq_reached(seq, mark->first) &&
+		    tx_seq_reached(mark->last, seq)) {
+			mark->failed = true;
+			found = true;
+			break;
+		}
+	}
+
+	if (err && !found && tx_seq_reached(seq, peer->tx_head_first)) {
+		peer->tx_head_failed = true;
+	}
+
+	while (peer->bcast_mark_count &&
+	       tx_seq_reached(seq, nus_peer_bcast_mark(peer, 0)->last)) {
+		done[count++] = *nus_peer_bcast_mark(peer, 0);
+		peer->bcast_mark_head = (peer->bcast_mark_head + 1) %
+					ARRAY_SIZE(peer->bcast_marks);
+		peer->bcast_mark_count--;
+	}
+
+	k_spin_unlock(&peer->bcast_lock, key);
+
+	for (size_t i = 0; i < count; i++) {
+		uart_data_bcast_done(done[i].buf, peer->id, !done[i].failed);
+		uart_data_unref(done[i].buf);
+	}
+}
+
+/* The link is gone, the broadcasts waiting for it failed for this peer */
+static void nus_peer_bcast_flush(struct nus_peer *peer)
+{
+	struct nus_bcast_mark done[ARRAY_SIZE(peer->bcast_marks)];
+	size_t count = 0;
+	k_spinlock_key_t key = k_spin_lock(&peer->bcast_lock);
+
+	while (peer->bcast_mark_count) {
+		done[count++] = *nus_peer_bcast_mark(peer, 0);
+		peer->bcast_mark_head = (peer->bcast_mark_head + 1) %
+					ARRAY_SIZE(peer->bcast_marks);
+		peer->bcast_mark_count--;
+	}
+
+	k_spin_unlock(&peer->bcast_lock, key);
+
+	for (size_t i = 0; i < count; i++) {
+		uart_data_bcast_done(done[i].buf, peer->id, false);
+		uart_data_unref(done[i].buf);
+	}
+}
+
+static void ble_data_sent(struct bt_nus_client *nus,uint8_t err, const uint8_t *const data, uint16_t len)
+{
+	struct nus_peer *peer = CONTAINER_OF(nus, struct nus_peer, client);
+
+	/* Return the credit to the connection the write was sent on, unless
+	 * the window of that connection shrank meanwhile.
+	 */
+	for (;;) {
+		atomic_val_t retired = atomic_get(&peer->tx_credits_retired);
+
+		if (retired <= 0) {
+			k_sem_give(&peer->tx_credits);
+			break;
+		}
+
+		if (atomic_cas(&peer->tx_credits_retired, retired, retired - 1)) {
+			break;
+		}
+	}
+
+	nus_peer_bcast_acked(peer, err);
+	k_sem_give(&nus_tx_kick);
+
+	if (err) {
+		LOG_WRN("ATT error code: 0x%02X", err);
+	}
+}
+
+static void ble_data_write_cmd_sent(struct bt_conn *conn, void *user_data)
+{
+	struct nus_peer *peer = user_data;
+
+	ble_data_sent(&peer->client, 0, NULL, 0);
+}
+
+/* A peer takes data once it is set up, and until it starts to disconnect */
+static bool nus_peer_ready(const struct nus_peer *peer)
+{
+	return nus_peer_state_get(peer->id) == NUS_PEER_READY;
+}
+
+/*	Issue the writes for data[*pos..len) to a single NUS server. The data
+*	is split into the largest writes that the negotiated ATT MTU of that
+*	link allows, so a line that fits in the MTU goes out as a single GATT
+*	write.
+*	Each write takes one of the connection's credits and ble_data_sent()
+*	returns it, so up to CONFIG_BT_NUS_TX_CREDITS writes are in flight per
+*	link. This never waits: it returns -EAGAIN when the window is full and
+*	*pos tells how far the data was issued.
+*/
+static int nus_write_chunks(struct nus_peer *peer, const uint8_t *data,
+			    uint16_t len, uint16_t *pos)
+{
+	int err = 0;
+	struct bt_nus_client *nus = &peer->client;
+
+	if (!nus_peer_ready(peer)) {
+		return -ENOTCONN;
+	}
+
+	const uint16_t payload_max = peer->mtu - NUS_ATT_WRITE_HEADER_LEN;
+
+	while (*pos < len) {
+		uint16_t chunk = MIN(len - *pos, payload_max);
+
+		if (k_sem_take(&peer->tx_credits, K_NO_WAIT)) {
+			return -EAGAIN;
+		}
+
+		/* Counted first, the write may complete at once */
+		atomic_inc(&peer->tx_issued);
+
+		if (peer->write_cmd) {
+			err = bt_gatt_write_without_response_cb(nus->conn,
+								nus->handles.rx,
+								&data[*pos], chunk,
+								false,
+								ble_data_write_cmd_sent,
+								peer);
+		} else {
+			err = bt_nus_client_send(nus, (const char *)&data[*pos],
+						 chunk);
+		}
+
+		if (err) {
+			atomic_dec(&peer->tx_issued);
+			k_sem_give(&peer->tx_credits);
+			LOG_WRN("Failed to send data over BLE connection"
+				"(err %d)",
+				err);
+			return err;
+		}
+
+		*pos += chunk;
+	}
+
+	return err;
+}
+
+/*	Queue a message for one peer. The queue takes over the caller's
+*	reference; when the queue is full the message is dropped and counted.
+*/
+static int nus_peer_enqueue(struct nus_peer *peer, struct uart_data_t *buf)
+{
+	if (k_msgq_put(&peer->tx_queue, &buf, K_NO_WAIT)) {
+		atomic_inc(&peer->tx_drops);
+		uart_data_unref(buf);
+		return -ENOBUFS;
+	}
+
+	k_sem_give(&nus_tx_kick);
+
+	return 0;
+}
+
+/*	Wait for room in a peer queue that was full, until the deadline. Only
+*	the host routers wait, so the host is slowed down rather than losing
+*	its data: while it waits the UART input backs up, see
+*	uart_flow_update(). Returns false once the deadline has passed, the
+*	message is then dropped for that peer so it cannot stall the port.
+*/
+static bool nus_tx_space_wait(struct host_port *port, int64_t deadline)
+{
+	int64_t left = deadline - k_uptime_get();
+
+	return (left > 0) && !k_sem_take(&port->tx_space, K_MSEC(left));
+}
+
+/*	Queue a message for the peer with the given stable ID. Takes the
+*	ownership of the buffer. Returns -ENOTCONN when that peer is not
+*	connected or not ready yet, -EACCES when the host port the message
+*	comes from does not serve it. A message from a host port waits up to
+*	CONFIG_BT_NUS_PEER_TX_WAIT for room in a full queue before it is
+*	dropped, port is NULL for messages from peers.
+*/
+static int nus_route_enqueue(int id, struct uart_data_t *buf,
+			     struct host_port *port)
+{
+	int64_t deadline = k_uptime_get() + CONFIG_BT_NUS_PEER_TX_WAIT;
+	bool wait = (port != NULL);
+	int err = -ENOTCONN;
+	bool full;
+
+	if ((id < 0) || (id >= PEER_TABLE_SIZE)) {
+		uart_data_unref(buf);
+		return err;
+	}
+
+	if (!host_port_serves(port, id)) {
+		uart_data_unref(buf);
+		return -EACCES;
+	}
+
+	/* Skip a peer that is not ready without taking the lock */
+	if (nus_peer_state_get(id) != NUS_PEER_READY) {
+		uart_data_unref(buf);
+		return err;
+	}
+
+	do {
+		full = false;
+
+		k_mutex_lock(&routes_lock, K_FOREVER);
+
+		if (routes[id] && nus_peer_ready(routes[id])) {
+			full = wait && !k_msgq_num_free_get(&routes[id]->tx_queue);
+			if (!full) {
+				err = nus_peer_enqueue(routes[id], buf);
+				buf = NULL;
+			}
+		}
+
+		k_mutex_unlock(&routes_lock);
+
+		if (full) {
+			wait = nus_tx_space_wait(port, deadline);
+		}
+	} while (full);
+
+	if (buf) {
+		uart_data_unref(buf);
+	}
+
+	return err;
+}
+
+static void nus_peer_tx_flush(struct nus_peer *peer)
+{
+	struct uart_data_t *buf;
+
+	nus_peer_bcast_flush(peer);
+
+	if (peer->tx_head) {
+		uart_data_bcast_done(peer->tx_head, peer->id, false);
+		uart_data_unref(peer->tx_head);
+		peer->tx_head = NULL;
+	}
+
+	while (!k_msgq_get(&peer->tx_queue, &buf, K_NO_WAIT)) {
+		uart_data_bcast_done(buf, peer->id, false);
+		uart_data_unref(buf);
+	}
+}
+
+/*	Issue as much of the peer's queue as its credits allow. Returns true
+*	when something was written, so the sender knows it made progress.
+*/
+static bool nus_peer_tx_service(struct nus_peer *peer)
+{
+	bool progress = false;
+
+	for (;;) {
+		int err;
+		uint16_t pos;
+		bool xoff = atomic_get(&peer->flow_xoff);
+
+		/* Flow control characters go ahead of the queued messages */
+		if (xoff != peer->flow_xoff_sent) {
+			static const uint8_t flow_ctrl[] = {NUS_FLOW_XON, NUS_FLOW_XOFF};
+
+			pos = 0;
+			err = nus_write_chunks(peer, &flow_ctrl[xoff], 1, &pos);
+			if (err == -EAGAIN) {
+				break;
+			}
+
+			peer->flow_xoff_sent = xoff;
+			progress |= (pos != 0);
+		}
+
+		if (!peer->tx_head) {
+			if (k_msgq_get(&peer->tx_queue, &peer->tx_head, K_NO_WAIT)) {
+				break;
+			}
+
+			peer->tx_pos = 0;
+			nus_peer_tx_head_start(peer);
+			k_sem_give(&host_port_of(peer->id)->tx_space);
+		}
+
+		pos = peer->tx_pos;
+		err = nus_write_chunks(peer,
+				       &peer->tx_head->data[peer->tx_head->off],
+				       peer->tx_head->len, &peer->tx_pos);
+		progress |= (peer->tx_pos != pos);
+
+		if (err == -EAGAIN) {
+			/* Window full, continue when a credit returns */
+			break;
+		}
+
+		if (err) {
+			uart_data_bcast_done(peer->tx_head, peer->id, false);
+		} else {
+			nus_peer_bcast_issued(peer, peer->tx_head);
+		}
+
+		uart_data_unref(peer->tx_head);
+		peer->tx_head = NULL;
+	}
+
+	return progress;
+}
+
+/*	The sender thread drains the per-peer TX queues. Each peer only waits
+*	for its own credits, so a slow peer cannot hold back the others.
+*/
+static void nus_sender_thread(void)
+{
+	for (;;) {
+		bool progress = false;
+
+		for (size_t i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+			const struct bt_conn_ctx *ctx =
+				bt_conn_ctx_get_by_id(&conns_ctx_lib, i);
+
+			if (ctx) {
+				progress |= nus_peer_tx_service(ctx->data);
+				bt_conn_ctx_release(&conns_ctx_lib,
+						    (void *)ctx->data);
+			}
+		}
+
+		if (!progress) {
+			k_sem_take(&nus_tx_kick, K_FOREVER);
+		}
+	}
+}
+
+K_THREAD_DEFINE(nus_sender_thread_id, CONFIG_BT_NUS_THREAD_STACK_SIZE,
+		nus_sender_thread, NULL, NULL, NULL, NUS_SENDER_PRIORITY, 0, 0);
+
+/*	Queue a message for every ready NUS server. Each peer queue takes a
+*	reference to the same buffer, so the payload is not copied and the
+*	peers are still drained independently. The caller keeps its own
+*	reference. The peers that could not take the message are reported.
+*	A message from a host port only goes to the peers of that port. It
+*	waits for room in the full queues up to CONFIG_BT_NUS_PEER_TX_WAIT in
+*	total, then it is dropped for the peers that are still full.
+*	The peers count down as they acknowledge the message, see
+*	uart_data_bcast_done(). This does not wait for them, the peers still
+*	pending after CONFIG_BT_NUS_BROADCAST_TIMEOUT are reported.
+*/
+static int multi_nus_broadcast(struct uart_data_t *buf, struct host_port *port)
+{
+	int64_t deadline = k_uptime_get() + CONFIG_BT_NUS_PEER_TX_WAIT;
+	bool wait = (port != NULL);
+	int err = 0;
+
+	buf->bcast = true;
+	buf->bcast_start = k_uptime_get();
+	atomic_set(&buf->bcast_pending, 1);
+	atomic_set(&buf->bcast_reported, 0);
+	for (size_t i = 0; i < ARRAY_SIZE(buf->bcast_failed); i++) {
+		atomic_set(&buf->bcast_waiting[i], 0);
+		atomic_set(&buf->bcast_failed[i], 0);
+	}
+
+	for (size_t i = 0; i < PEER_TABLE_SIZE; i++) {
+		bool full = false;
+
+		if (!host_port_serves(port, i) ||
+		    (nus_peer_state_get(i) != NUS_PEER_READY)) {
+			continue;
+		}
+
+		k_mutex_lock(&routes_lock, K_FOREVER);
+
+		struct nus_peer *peer = routes[i];
+
+		if (peer && nus_peer_ready(peer)) {
+			full = wait && !k_msgq_num_free_get(&peer->tx_queue);
+			if (!full) {
+				/* Counted first, the sender may be done at once */
+				atomic_inc(&buf->bcast_pending);
+				atomic_set_bit(buf->bcast_waiting, i);
+
+				if (nus_peer_enqueue(peer, uart_data_ref(buf))) {
+					uart_data_bcast_done(buf, i, false);
+					err = -ENOBUFS;
+				}
+			}
+		}
+
+		k_mutex_unlock(&routes_lock);
+
+		if (full) {
+			/* Try the same peer again, without waiting after the deadline */
+			wait = nus_tx_space_wait(port, deadline);
+			i--;
+		}
+	}
+
+	if (atomic_get(&buf->bcast_pending) > 1) {
+		bcast_watch_add(buf);
+	}
+
+	uart_data_bcast_done(buf, -1, true);
+
+	return err;
+}
+
+/*	Parse the routing header of the next chunk of an input stream.
+* 	Extensions to the behavior of message routing can be made here.
+*	If the first character of a message is *, this indicates a routed message.
+* 	The two characters after the * are read as the peer number and the message
+*	will be sent only to that peer. Numbers must be written as two digits, i.e 01
+*	for 1, and 99 broadcasts the message to all peers. 98 addresses the
+*	central itself.
+*	A message without a valid header goes to the default destination of the
+*	stream, unchanged. The destination holds for the following chunks until
+*	a chunk ends with '\n' or '\r'.
+*	Returns the destination and sets *hdr_len to the header bytes to strip.
+*/
+static int route_parse(struct route_parser *parser, const uint8_t *data,
+		       uint16_t len, uint16_t *hdr_len)
+{
+	*hdr_len = 0;
+
+	if (!len) {
+		return parser->in_message ? parser->dest : parser->default_dest;
+	}
+
+	/*Handle the routing of the message only at the beginning of the message*/
+	if (!parser->in_message) {
+		parser->in_message = true;
+		parser->dest = parser->default_dest;
+
+		/*Check if it's a routed message*/
+		if ((len >= 3) && (data[0] == ROUTED_MESSAGE_CHAR) &&
+		    isdigit(data[1]) && isdigit(data[2])) {
+			/*Determine who the intended recipient is*/
+			int nus_index = (data[1] - '0') * 10 + (data[2] - '0');
+
+			/*Is this a number that makes sense?*/
+			if ((nus_index < PEER_TABLE_SIZE) ||
+			    (nus_index == CENTRAL_INDEX) ||
+			    (nus_index == BROADCAST_INDEX)) {
+				parser->dest = nus_index;
+				*hdr_len = 3;
+			}
+		}
+	}
+
+	if ((data[len - 1] == '\n') || (data[len - 1] == '\r')) {
+		parser->in_message = false;
+	}
+
+	return parser->dest;
+}
+
+/*	New function for sending data into the multi-NUS
+*	The routing header has already been parsed and stripped, see
+*	route_parse(). dest is a peer ID or BROADCAST_INDEX to send the message
+*	to all peers.
+*	The message is queued for the sender thread, which takes over the
+*	caller's reference to buf. port is the host port the message comes
+*	from, its router waits for room in the peer queues. It is NULL for the
+*	peers, they never wait, so a peer's message is dropped when the
+*	destination queue is full.
+*/
+static int multi_nus_send(struct uart_data_t *buf, int dest,
+			  struct host_port *port)
+{
+	int err = 0;
+
+	LOG_INF("Multi-Nus Send");
+
+	if (!buf->len || (dest == ROUTE_DEST_NONE) || (dest == CENTRAL_INDEX)) {
+		uart_data_unref(buf);
+		return 0;
+	}
+
+	/*	If it's a routed message, send it to that guy. 
+	*	If it's not, broadcast it to everyone.
+	*/
+	if (dest != BROADCAST_INDEX) {
+		LOG_INF("Trying to send to server %d", dest);
+
+		err = nus_route_enqueue(dest, buf, port);
+		if (err == -ENOBUFS) {
+			LOG_WRN("TX queue of server %d is full", dest);
+		} else if (err == -EACCES) {
+			LOG_WRN("Server %d is not served by UART %d", dest,
+				port->index);
+		} else if (err) {
+			LOG_WRN("Server %d is not connected", dest);
+		}
+	} else {//Broadcast message
+		LOG_INF("Broadcast");
+		err = multi_nus_broadcast(buf, port);
+		uart_data_unref(buf);
+	}
+
+	return err;
+}
+
+/*	Peer-to-peer fast path: queue a routed payload for its destination
+*	without a detour through the UART. A notification that fits in a
+*	payload buffer is forwarded as a single message.
+*	The notification belongs to the Bluetooth stack until this returns, so
+*	it is copied once. All the destinations of a broadcast share the copy.
+*/
+static void nus_forward(int dest, const uint8_t *data, uint16_t len)
+{
+	for (uint16_t pos = 0; pos != len;) {
+		struct uart_data_t *fwd = uart_data_alloc();
+
+		if (!fwd) {
+			LOG_WRN("Not able to allocate routed data buffer");
+			return;
+		}
+
+		fwd->len = MIN(len - pos, sizeof(fwd->data));
+		memcpy(fwd->data, &data[pos], fwd->len);
+		pos += fwd->len;
+
+		/* Same line end as on the UART, when there is room for it */
+		if ((pos == len) && (data[len - 1] == '\r') &&
+		    (fwd->len < sizeof(fwd->data))) {
+			fwd->data[fwd->len] = '\n';
+			fwd->len++;
+		}
+
+		multi_nus_send(fwd, dest, NULL);
+	}
+}
+
+/*	This function has been updated to add the ability for a peer to route a message by
+*	appending a '*' as in the multi-NUS send function. So a peer could send the message
+*	*00 to send a message to peer 0. If the peer sends a *99, that message is broadcast to 
+*	all peers
+*	The routing header is parsed once per notification and routed messages
+*	take the fast path above. They are only written to the UART as well
+*	when the host asked to mirror them. Everything else goes to the UART
+*	of the host port that serves the peer.
+*	With source tagging on, each line written to the UART starts with the
+*	ID of the peer in the same "*NN" form as the routing header, so the
+*	host can demultiplex the peers, or route a reply by sending the line
+*	back.
+*/
+
+static uint8_t ble_data_received(struct bt_nus_client *nus,const uint8_t *const data, uint16_t len)
+{
+	int err;
+	struct nus_peer *peer = CONTAINER_OF(nus, struct nus_peer, client);
+	struct host_port *port = host_port_of(peer->id);
+	uint16_t hdr_len;
+	int dest = route_parse(&peer->route, data, len, &hdr_len);
+
+	if ((dest != ROUTE_DEST_NONE) && (dest != CENTRAL_INDEX)) {
+		nus_forward(dest, &data[hdr_len], len - hdr_len);
+
+		if (!atomic_get(&port->mirror)) {
+			return BT_GATT_ITER_CONTINUE;
+		}
+	}
+
+	bool tag = atomic_get(&port->tag);
+	bool line_start = peer->uart_line_start;
+	char tag_str[sizeof("*00")];
+	struct uart_tx_seg segs[3];
+	size_t count = 0;
+
+	if (!len) {
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	if (atomic_get(&port->framing)) {
+		err = uart_tx_frames(port, peer->id, data, len);
+		if (err) {
+			LOG_WRN("UART TX ring full, frame from server %d dropped",
+				peer->id);
+		}
+
+		nus_peer_flow_update(peer);
+
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	peer->uart_line_start = (data[len - 1] == '\n') ||
+				(data[len - 1] == '\r');
+
+	if (tag) {
+		segs[count].data = tag_str;
+		segs[count].len = snprintf(tag_str, sizeof(tag_str), "%c%02d",
+					   ROUTED_MESSAGE_CHAR, peer->id);
+		count++;
+	}
+
+	segs[count].data = data;
+	segs[count].len = len;
+	count++;
+
+	/* Append the LF character when the CR character triggered
+	 * transmission from the peer.
+	 */
+	if (data[len - 1] == '\r') {
+		segs[count].data = "\n";
+		segs[count].len = 1;
+		count++;
+	}
+
+	/*	A line that continues is tagged again when the output of
+	*	another source came in between, so every byte on the UART can
+	*	be told apart.
+	*/
+	err = uart_tx_write(port, segs, count, peer->id, tag && !line_start);
+	if (err) {
+		LOG_WRN("UART TX ring full, %u bytes from server %d dropped",
+			len, peer->id);
+	}
+
+	nus_peer_flow_update(peer);
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+static uint8_t *uart_rx_buf_alloc(void)
+{
+	uint8_t *buf;
+
+	if (k_mem_slab_alloc(&uart_rx_slab, (void **)&buf, K_NO_WAIT)) {
+		return NULL;
+	}
+
+	return buf;
+}
+
+static int uart_rx_start(struct host_port *port)
+{
+	int err;
+	uint8_t *buf = uart_rx_buf_alloc();
+
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	err = uart_rx_enable(port->uart, buf, CONFIG_BT_NUS_UART_RX_BUF_SIZE,
+			     UART_RX_TIMEOUT);
+	if (err) {
+		k_mem_slab_free(&uart_rx_slab, buf);
+	}
+
+	return err;
+}
+
+/*	Backpressure towards the host. Reception is paused when the router has
+*	CONFIG_BT_NUS_UART_RX_HIGH_WATERMARK messages waiting and resumed when
+*	it is down to CONFIG_BT_NUS_UART_RX_LOW_WATERMARK. While reception is
+*	stopped a UART with hardware flow control deasserts RTS, and on USB the
+*	adapter stops reading the CDC ACM endpoint so the host gets NAKed. DSR
+*	in the line state follows the pause as well. Each port is paused on
+*	its own.
+*/
+static void uart_flow_work_handler(struct k_work *item)
+{
+	struct host_port *port = CONTAINER_OF(item, struct host_port, flow_work);
+	bool paused = atomic_get(&port->rx_paused);
+
+	if (IS_ENABLED(CONFIG_UART_LINE_CTRL)) {
+		uart_line_ctrl_set(port->uart, UART_LINE_CTRL_DSR, !paused);
+	}
+
+	if (paused) {
+		LOG_INF("UART %d reception paused", port->index);
+		uart_rx_disable(port->uart);
+	} else {
+		LOG_INF("UART %d reception resumed", port->index);
+		/* When reception is still stopping, UART_RX_DISABLED restarts it */
+		if (uart_rx_start(port) == -ENOMEM) {
+			k_work_schedule(&port->rx_work, UART_WAIT_FOR_BUF_DELAY);
+		}
+	}
+}
+
+/* Called with the number of messages waiting for the port's router */
+static void uart_flow_update(struct host_port *port, atomic_val_t queued)
+{
+	/* Pausing a UART without flow control only loses the input */
+	if (!port->rx_flow_ctrl) {
+		return;
+	}
+
+	if ((queued >= CONFIG_BT_NUS_UART_RX_HIGH_WATERMARK) &&
+	    atomic_cas(&port->rx_paused, 0, 1)) {
+		k_work_submit(&port->flow_work);
+	} else if ((queued <= CONFIG_BT_NUS_UART_RX_LOW_WATERMARK) &&
+		   atomic_cas(&port->rx_paused, 1, 0)) {
+		k_work_submit(&port->flow_work);
+	}
+}
+
+/*	Commands that switch the framing of the host UART. They take effect
+*	in the UART receiver, so the bytes right after the command are already
+*	read in the new mode. Returns the new mode, or -1 for other data.
+*/
+static int uart_framing_command(const uint8_t *cmd, size_t len)
+{
+	static const char cobs[] = "framing cobs";
+	static const char text[] = "framing text";
+
+	while (len && ((cmd[len - 1] == '\n') || (cmd[len - 1] == '\r'))) {
+		len--;
+	}
+
+	if ((len == strlen(cobs)) && !memcmp(cmd, cobs, len)) {
+		return 1;
+	} else if ((len == strlen(text)) && !memcmp(cmd, text, len)) {
+		return 0;
+	}
+
+	return -1;
+}
+
+static void uart_rx_queue(struct host_port *port)
+{
+	/* The buffer is kept for the next message */
+	if (!port->rx_flow_ctrl &&
+	    (atomic_get(&port->rx_queued) >= CONFIG_BT_NUS_UART_RX_HIGH_WATERMARK)) {
+		atomic_add(&port->rx_drops, port->rx_line->len);
+		port->rx_line->len = 0;
+		port->rx_line->framed = false;
+		return;
+	}
+
+	k_fifo_put(&port->rx_fifo, port->rx_line);
+	port->rx_line = NULL;
+	uart_flow_update(port, atomic_inc(&port->rx_queued) + 1);
+}
+
+/*	Text mode: a message ends with '\n' or '\r', or when the payload
+*	buffer is full. Returns the bytes consumed, up to the end of the first
+*	complete message.
+*/
+static size_t uart_rx_text(struct host_port *port, const uint8_t *data,
+			   size_t len)
+{
+	struct uart_data_t *line = port->rx_line;
+	size_t chunk;
+	bool line_end = false;
+
+	/* A CR LF line end ends one message, not two */
+	if (port->rx_cr && !line->len && (data[0] == '\n')) {
+		port->rx_cr = false;
+		return 1;
+	}
+
+	port->rx_cr = false;
+
+	chunk = MIN(len, sizeof(line->data) - line->len);
+	for (size_t i = 0; i < chunk; i++) {
+		if ((data[i] == '\n') || (data[i] == '\r')) {
+			chunk = i + 1;
+			line_end = true;
+			break;
+		}
+	}
+
+	memcpy(&line->data[line->len], data, chunk);
+	line->len += chunk;
+
+	if (line_end) {
+		port->rx_cr = (data[chunk - 1] == '\r');
+
+		/* An empty line is not a message, it would be broadcast */
+		if ((line->len == 1) && !port->rx_continued) {
+			line->len = 0;
+			return chunk;
+		}
+	}
+
+	if (line_end || (line->len == sizeof(line->data))) {
+		int framing = -1;
+
+		/* A line cut by a full buffer continues in the next message */
+		if (line_end && !port->rx_continued && (line->len > 3) &&
+		    (line->data[0] == ROUTED_MESSAGE_CHAR) &&
+		    !memcmp(&line->data[1], STRINGIFY(CENTRAL_INDEX), 2)) {
+			framing = uart_framing_command(&line->data[3],
+						       line->len - 3);
+		}
+
+		if (framing >= 0) {
+			atomic_set(&port->framing, framing);
+		}
+
+		port->rx_continued = !line_end;
+		uart_rx_queue(port);
+	}
+
+	return chunk;
+}
+
+/*	Framed mode: decode COBS frames, see uart_frame.h. The destination is
+*	taken from the frame header, the payload is never parsed. Returns the
+*	bytes consumed, up to the end of the first complete frame.
+*/
+static size_t uart_rx_cobs(struct host_port *port, const uint8_t *data,
+			   size_t len)
+{
+	struct uart_data_t *line = port->rx_line;
+
+	for (size_t i = 0; i < len; i++) {
+		enum uart_frame_status status;
+
+		status = uart_frame_decode(&port->rx_dec, data[i], line->data,
+					   sizeof(line->data));
+		if (status == UART_FRAME_PENDING) {
+			continue;
+		}
+
+		uint8_t type = uart_frame_type_get(&port->rx_dec);
+
+		if ((status == UART_FRAME_INVALID) ||
+		    ((type != UART_FRAME_DATA) && (type != UART_FRAME_COMMAND))) {
+			LOG_WRN("Invalid UART frame dropped");
+			line->len = 0;
+			return i + 1;
+		}
+
+		line->len = uart_frame_len_get(&port->rx_dec);
+		line->framed = true;
+
+		if (type == UART_FRAME_COMMAND) {
+			int framing = uart_framing_command(line->data, line->len);
+
+			if (framing >= 0) {
+				atomic_set(&port->framing, framing);
+			}
+
+			line->dest = CENTRAL_INDEX;
+		} else {
+			line->dest = uart_frame_addr_get(&port->rx_dec);
+		}
+
+		uart_rx_queue(port);
+
+		return i + 1;
+	}
+
+	return len;
+}
+
+/*	Split the continuous UART byte stream into messages, as text lines or
+*	as binary frames. Complete messages are queued for the port's router
+*	while the receiver keeps running.
+*/
+static void uart_rx_frame(struct host_port *port, const uint8_t *data,
+			  size_t len)
+{
+	while (len) {
+		size_t consumed;
+
+		if (!port->rx_line) {
+			port->rx_line = uart_data_alloc();
+			if (!port->rx_line) {
+				LOG_WRN("Not able to allocate UART receive buffer, "
+					"%u bytes dropped", (unsigned int)len);
+				atomic_add(&port->rx_drops, len);
+				return;
+			}
+		}
+
+		if (atomic_get(&port->framing)) {
+			consumed = uart_rx_cobs(port, data, len);
+		} else {
+			consumed = uart_rx_text(port, data, len);
+		}
+
+		data += consumed;
+		len -= consumed;
+	}
+}
+
+static void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
+{
+	struct host_port *port = user_data;
+
+	uint8_t *rx_buf;
+
+	switch (evt->type) {
+	case UART_TX_DONE:
+		uart_tx_done(port, evt->data.tx.len);
+
+		break;
+
+	case UART_RX_RDY:
+		uart_rx_frame(port, &evt->data.rx.buf[evt->data.rx.offset],
+			      evt->data.rx.len);
+
+		break;
+
+	case UART_RX_DISABLED:
+		/* Reception stops on errors and for backpressure, restart it
+		 * unless it is paused.
+		 */
+		if (atomic_get(&port->rx_paused)) {
+			break;
+		}
+
+		if (uart_rx_start(port)) {
+			LOG_WRN("Not able to restart UART %d reception",
+				port->index);
+			k_work_schedule(&port->rx_work,
+					      UART_WAIT_FOR_BUF_DELAY);
+		}
+
+		break;
+
+	case UART_RX_BUF_REQUEST:
+		rx_buf = uart_rx_buf_alloc();
+		if (rx_buf) {
+			uart_rx_buf_rsp(dev, rx_buf, CONFIG_BT_NUS_UART_RX_BUF_SIZE);
+		} else {
+			LOG_WRN("Not able to allocate UART receive buffer");
+		}
+
+		break;
+
+	case UART_RX_BUF_RELEASED:
+		k_mem_slab_free(&uart_rx_slab, evt->data.rx_buf.buf);
+
+		break;
+
+	case UART_RX_STOPPED:
+		LOG_WRN("UART %d reception stopped (reason %d)", port->index,
+			evt->data.rx_stop.reason);
+
+		break;
+
+	case UART_TX_ABORTED:
+		/* Send the rest of the aborted transfer */
+		uart_tx_done(port, evt->data.tx.len);
+
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void uart_work_handler(struct k_work *item)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(item);
+	struct host_port *port = CONTAINER_OF(dwork, struct host_port, rx_work);
+
+	if (atomic_get(&port->rx_paused)) {
+		return;
+	}
+
+	if (uart_rx_start(port)) {
+		LOG_WRN("Not able to restart UART %d reception", port->index);
+		k_work_schedule(&port->rx_work, UART_WAIT_FOR_BUF_DELAY);
+	}
+}
+
+//WRC
+static bool uart_test_async_api(const struct device *dev)
+{
+	const struct uart_driver_api *api =
+			(const struct uart_driver_api *)dev->api;
+
+	return (api->callback_set != NULL);
+}
+
+/* Default set of peers of each port, see nus-uart-first-peer */
+static uint8_t host_port_default(uint8_t id)
+{
+#if DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, nus_uart_first_peer)
+	uint8_t index = 0;
+
+	for (uint8_t i = 0; i < HOST_PORT_COUNT; i++) {
+		if (id >= host_port_first_peer[i]) {
+			index = i;
+		}
+	}
+
+	return index;
+#else
+	/* Equal shares of the peer IDs */
+	return (id * HOST_PORT_COUNT) / PEER_TABLE_SIZE;
+#endif
+}
+
+static int host_port_init(struct host_port *port, const struct device *adapter)
+{
+	int err;
+
+	if (!device_is_ready(port->uart)) {
+		LOG_ERR("UART %d device not ready", port->index);
+		return -ENODEV;
+	}
+
+	k_work_init_delayable(&port->rx_work, uart_work_handler);
+	k_work_init(&port->flow_work, uart_flow_work_handler);
+	k_fifo_init(&port->rx_fifo);
+	k_sem_init(&port->tx_space, 0, 1);
+	ring_buf_init(&port->tx_ring, sizeof(port->tx_ring_buf), port->tx_ring_buf);
+	port->tx_last_src = UART_TX_SRC_NONE;
+
+	port->route.default_dest = BROADCAST_INDEX;
+	atomic_set(&port->mirror, IS_ENABLED(CONFIG_BT_NUS_UART_MIRROR_ROUTED));
+	atomic_set(&port->framing, IS_ENABLED(CONFIG_BT_NUS_UART_FRAMING_COBS));
+	atomic_set(&port->tag, IS_ENABLED(CONFIG_BT_NUS_UART_SOURCE_TAG));
+
+	//WRC
+	if (adapter && !uart_test_async_api(port->uart)) {
+		/* Implement API adapter */
+		uart_async_adapter_init(adapter, port->uart);
+		port->uart = adapter;
+		port->adapted = true;
+	}
+
+	if (IS_ENABLED(CONFIG_UART_LINE_CTRL)) {
+		/* DSR tells the host that the central takes data */
+		uart_line_ctrl_set(port->uart, UART_LINE_CTRL_DSR, 1);
+	}
+
+	err = uart_callback_set(port->uart, uart_cb, port);
+	if (err) {
+		return err;
+	}
+
+	return uart_rx_start(port);
+}
+
+static int uart_init(void)
+{
+	int err;
+#if CONFIG_BT_NUS_UART_ASYNC_ADAPTER
+	const struct device *const adapters[HOST_PORT_COUNT] = {
+		HOST_PORT_FOREACH(HOST_PORT_ADAPTER)
+	};
+#else
+	const struct device *const adapters[HOST_PORT_COUNT] = {NULL};
+#endif
+
+	//WRC
+
+	if (IS_ENABLED(CONFIG_USB_DEVICE_STACK)) {
+		err = usb_enable(NULL);
+		if (err && (err != -EALREADY)) {
+			LOG_ERR("Failed to enable USB");
+			return err;
+		}
+	}
+
+	for (uint8_t id = 0; id < PEER_TABLE_SIZE; id++) {
+		atomic_set(&peer_ports[id], host_port_default(id));
+	}
+
+	for (size_t i = 0; i < HOST_PORT_COUNT; i++) {
+		err = host_port_init(&host_ports[i], adapters[i]);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*	Scanning goes on while connected peers are still in discovery, so many
+*	peers come online in parallel. Up to CONFIG_BT_NUS_MAX_PENDING_SETUP
+*	peers are set up at a time. Only one connection is initiated at a time:
+*	the scan module stops scanning to connect, and scanning is resumed when
+*	the connection is established or fails.
+*/
+static void scan_resume(void)
+{
+	int err;
+
+	if (default_conn ||
+	    (atomic_get(&peers_in_setup) >= CONFIG_BT_NUS_MAX_PENDING_SETUP) ||
+	    (bt_conn_ctx_count(&conns_ctx_lib) >= CONFIG_BT_MAX_CONN)) {
+		return;
+	}
+
+	err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
+	if (err && (err != -EALREADY)) {
+		LOG_ERR("Scanning failed to start (err %d)", err);
+	}
+}
+
+/*	A peer left the setup, because it is ready or because it is gone.
+*	Called with the context of the peer held, from the Bluetooth thread or
+*	from the discovery work.
+*/
+static void peer_setup_end(struct nus_peer *peer, bool ready)
+{
+	if (!peer->in_setup) {
+		return;
+	}
+
+	peer->in_setup = false;
+
+	if (ready) {
+		peer->ready = true;
+		atomic_inc(&peers_ready);
+		LOG_INF("Server %d ready %u ms after connecting", peer->id,
+			(unsigned int)(k_uptime_get() - peer->connected_at));
+	}
+
+	if (atomic_dec(&peers_in_setup) == 1) {
+		LOG_INF("%u servers ready in %u ms since bring-up",
+			(unsigned int)atomic_get(&peers_ready),
+			(unsigned int)(k_uptime_get() - bringup_start));
+	}
+
+	scan_resume();
+}
+
+static void gatt_discover(struct bt_conn *conn);
+
+/* Disconnect a peer that cannot be used, it takes no data until it is gone */
+static void nus_peer_drop(struct bt_conn *conn)
+{
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	if (peer) {
+		nus_peer_state_set(peer, NUS_PEER_DISCONNECTING);
+		/* Its place in the setup goes to the next peer right away */
+		peer_setup_end(peer, false);
+		bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+	}
+
+	bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+}
+
+/*	bt_gatt_dm runs one discovery at a time. The connections that need one
+*	wait in this queue, each of them once, and the discovery work starts
+*	them in turn. A failed discovery is queued again with a delay that
+*	doubles at each attempt, and the peer is dropped after the last one.
+*/
+#define DISCOVER_RETRY_MAX 3
+#define DISCOVER_RETRY_DELAY_MS 100
+
+struct discover_request {
+	/* Referenced while the request is queued or running */
+	struct bt_conn *conn;
+	uint8_t attempts;
+	/* Uptime before which a retry does not start */
+	int64_t not_before;
+};
+
+static struct discover_request discover_queue[CONFIG_BT_MAX_CONN];
+static size_t discover_count;
+/* The discovery in progress, conn is NULL when there is none */
+static struct discover_request discover_current;
+static K_MUTEX_DEFINE(discover_lock);
+
+static struct bt_gatt_dm_cb discovery_cb;
+
+static void discover_work_handler(struct k_work *item);
+
+static K_WORK_DELAYABLE_DEFINE(discover_work, discover_work_handler);
+
+/* Called with discover_lock held */
+static int discover_find(const struct bt_conn *conn)
+{
+	for (size_t i = 0; i < discover_count; i++) {
+		if (discover_queue[i].conn == conn) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* Called with discover_lock held */
+static struct discover_request discover_take(size_t i)
+{
+	struct discover_request req = discover_queue[i];
+
+	discover_count--;
+	memmove(&discover_queue[i], &discover_queue[i + 1],
+		(discover_count - i) * sizeof(discover_queue[0]));
+
+	return req;
+}
+
+/* Queue a discovery of the connection, unless it is queued or running */
+static void discover_request(struct bt_conn *conn)
+{
+	bool queued = false;
+
+	k_mutex_lock(&discover_lock, K_FOREVER);
+	if ((discover_current.conn != conn) && (discover_find(conn) < 0)) {
+		discover_queue[discover_count++] = (struct discover_request) {
+			.conn = bt_conn_ref(conn),
+		};
+		queued = true;
+	}
+	k_mutex_unlock(&discover_lock);
+
+	if (queued) {
+		k_work_reschedule(&discover_work, K_NO_WAIT);
+	}
+}
+
+/* Drop the queued discovery of a connection that is gone */
+static void discover_cancel(struct bt_conn *conn)
+{
+	struct discover_request req = {0};
+	int i;
+
+	k_mutex_lock(&discover_lock, K_FOREVER);
+	i = discover_find(conn);
+	if (i >= 0) {
+		req = discover_take(i);
+	}
+	k_mutex_unlock(&discover_lock);
+
+	if (req.conn) {
+		bt_conn_unref(req.conn);
+	}
+}
+
+/* The discovery in progress ended, the next one can start */
+static void discover_end(struct bt_conn *conn, bool failed)
+{
+	struct discover_request req;
+	bool give_up = false;
+
+	k_mutex_lock(&discover_lock, K_FOREVER);
+
+	if (discover_current.conn != conn) {
+		k_mutex_unlock(&discover_lock);
+		return;
+	}
+
+	req = discover_current;
+	discover_current.conn = NULL;
+
+	if (failed && (req.attempts < DISCOVER_RETRY_MAX)) {
+		uint32_t delay = DISCOVER_RETRY_DELAY_MS << req.attempts;
+
+		req.attempts++;
+		req.not_before = k_uptime_get() + delay;
+		discover_queue[discover_count++] = req;
+		req.conn = NULL;
+
+		LOG_WRN("Discovery retry %u in %u ms", req.attempts, delay);
+	} else if (failed) {
+		give_up = true;
+	}
+
+	k_mutex_unlock(&discover_lock);
+
+	if (req.conn) {
+		if (give_up) {
+			LOG_ERR("Discovery failed %u times, disconnecting",
+				req.attempts + 1);
+			nus_peer_drop(req.conn);
+		}
+
+		bt_conn_unref(req.conn);
+	}
+
+	k_work_reschedule(&discover_work, K_NO_WAIT);
+}
+
+static void discover_work_handler(struct k_work *item)
+{
+	struct bt_conn *conn = NULL;
+	int64_t now = k_uptime_get();
+	int64_t wait = -1;
+	int err;
+
+	k_mutex_lock(&discover_lock, K_FOREVER);
+
+	for (size_t i = 0; !discover_current.conn && (i < discover_count); i++) {
+		int64_t left = discover_queue[i].not_before - now;
+
+		if (left <= 0) {
+			discover_current = discover_take(i);
+			conn = discover_current.conn;
+		} else if ((wait < 0) || (left < wait)) {
+			wait = left;
+		}
+	}
+
+	k_mutex_unlock(&discover_lock);
+
+	if (!conn) {
+		/* Busy, or only retries that are not due yet */
+		if (wait > 0) {
+			k_work_reschedule(&discover_work, K_MSEC(wait));
+		}
+
+		return;
+	}
+
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	/* Gone, or set up from the cache while it waited */
+	if (!peer || peer->client.conn) {
+		if (peer) {
+			bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+		}
+
+		discover_end(conn, false);
+		return;
+	}
+
+	err = bt_gatt_dm_start(conn,
+			       BT_UUID_NUS_SERVICE,
+			       &discovery_cb,
+			       &peer->client);
+
+	bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+
+	if (err) {
+		LOG_ERR("could not start the discovery procedure, error "
+			"code: %d", err);
+		discover_end(conn, true);
+	}
+}
+
+/*	Set the number of writes that can be in flight on a link. The credits
+*	of writes in flight are kept: a larger window gives the new credits,
+*	a smaller one takes the free credits and drops the others when their
+*	writes complete.
+*/
+static void nus_peer_credits_resize(struct nus_peer *peer, uint8_t limit)
+{
+	for (; peer->tx_credit_limit < limit; peer->tx_credit_limit++) {
+		k_sem_give(&peer->tx_credits);
+	}
+
+	for (; peer->tx_credit_limit > limit; peer->tx_credit_limit--) {
+		if (k_sem_take(&peer->tx_credits, K_NO_WAIT)) {
+			atomic_inc(&peer->tx_credits_retired);
+		}
+	}
+}
+
+/*	Last step of the setup, once the NUS handles are known from a discovery
+*	or from the cache: the writes can start and the server gets its ID.
+*/
+static void nus_peer_setup_done(struct nus_peer *peer)
+{
+	int err;
+
+	/*	Pipeline the writes with Write Without Response when the server
+	*	allows it. Otherwise a Write Request is used and the NUS client
+	*	allows only one of them in flight.
+	*/
+	nus_peer_credits_resize(peer, peer->write_cmd ? CONFIG_BT_NUS_TX_CREDITS : 1);
+
+	LOG_INF("Link parameters: MTU %u, TX %u bytes/%u us, RX %u bytes/%u us",
+		peer->mtu, peer->tx_octets, peer->tx_time,
+		peer->rx_octets, peer->rx_time);
+
+	nus_peer_state_set(peer, NUS_PEER_READY);
+	peer_setup_end(peer, true);
+
+	/*	Send a message to the new NUS server informing it of its ID in this
+	*	mini-network. The ID comes from the peer table, so a bonded server
+	*	keeps it across reconnects and reboots.
+	*/
+	struct uart_data_t *buf = uart_data_alloc();
+
+	if (buf) {
+		buf->len = snprintf((char *)buf->data, sizeof(buf->data), "%02d\r",
+				    peer->id);
+
+		err = nus_peer_enqueue(peer, buf);
+		if (!err) {
+			LOG_INF("Sent ID to server %d", peer->id);
+		}
+	}
+}
+
+static void discovery_complete(struct bt_gatt_dm *dm,
+			       void *context)
+{
+	struct bt_nus_client *nus = context;
+	struct nus_peer *peer = CONTAINER_OF(nus, struct nus_peer, client);
+	struct bt_conn *conn = bt_gatt_dm_conn_get(dm);
+	const struct bt_gatt_dm_attr *rx_chrc;
+	const struct bt_gatt_chrc *chrc_val = NULL;
+	LOG_INF("Service discovery completed");
+
+	bt_gatt_dm_data_print(dm);
+
+	rx_chrc = bt_gatt_dm_char_by_uuid(dm, BT_UUID_NUS_RX);
+	if (rx_chrc) {
+		chrc_val = bt_gatt_dm_attr_chrc_val(rx_chrc);
+	}
+
+	peer->write_cmd = chrc_val &&
+			  (chrc_val->properties & BT_GATT_CHRC_WRITE_WITHOUT_RESP);
+
+	bt_nus_handles_assign(dm, nus);
+	bt_nus_subscribe_receive(nus);
+
+	/*	A bonded server skips the discovery when it reconnects, as long as
+	*	its Database Hash stays the same.
+	*/
+	if (peer->db_hash_state == DB_HASH_VALID) {
+		struct peer_table_handles handles = {
+			.rx = nus->handles.rx,
+			.tx = nus->handles.tx,
+			.tx_ccc = nus->handles.tx_ccc,
+			.write_cmd = peer->write_cmd,
+		};
+
+		memcpy(handles.db_hash, peer->db_hash, sizeof(handles.db_hash));
+		peer_table_handles_set(peer->id, &handles);
+	} else {
+		peer_table_handles_clear(peer->id);
+	}
+
+	bt_gatt_dm_data_release(dm);
+	discover_end(conn, false);
+
+	nus_peer_setup_done(peer);
+}
+
+static void discovery_service_not_found(struct bt_conn *conn,
+					void *context)
+{
+	LOG_INF("Service not found");
+	discover_end(conn, false);
+
+	/* Not a NUS server, give its place in the setup to another peer */
+	nus_peer_drop(conn);
+}
+
+static void discovery_error(struct bt_conn *conn,
+			    int err,
+			    void *context)
+{
+	LOG_WRN("Error while discovering GATT database: (%d)", err);
+	discover_end(conn, true);
+}
+
+static struct bt_gatt_dm_cb discovery_cb = {
+	.completed         = discovery_complete,
+	.service_not_found = discovery_service_not_found,
+	.error_found       = discovery_error,
+};
+
+static const struct bt_nus_client_init_param nus_client_init_param = {
+	.cb = {
+		.received = ble_data_received,
+		.sent = ble_data_sent,
+	}
+};
+
+/* Start over with a client that has no handles */
+static void nus_client_reset(struct nus_peer *peer)
+{
+	memset(&peer->client, 0, sizeof(peer->client));
+	bt_nus_client_init(&peer->client, &nus_client_init_param);
+}
+
+/*	The write of the TX CCC descriptor is the last request needed to set up
+*	a server from the cache. If it fails, the cached handles are wrong even
+*	though the Database Hash matched, and a discovery follows.
+*/
+static void gatt_cache_subscribed(struct bt_conn *conn, uint8_t err,
+				  struct bt_gatt_subscribe_params *params)
+{
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	if (!peer) {
+		return;
+	}
+
+	params->subscribe = NULL;
+
+	if (!err) {
+		LOG_INF("Server %d set up from the cached handles", peer->id);
+		nus_peer_setup_done(peer);
+	} else {
+		LOG_WRN("Cached handles of server %d failed (err %u)",
+			peer->id, err);
+		peer_table_handles_clear(peer->id);
+		nus_client_reset(peer);
+	}
+
+	bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+
+	if (err) {
+		gatt_discover(conn);
+	}
+}
+
+/* Set up a bonded server with the handles found by its last discovery */
+static bool gatt_cache_apply(struct bt_conn *conn, struct nus_peer *peer)
+{
+	struct peer_table_handles handles;
+	int err;
+
+	if ((peer->db_hash_state != DB_HASH_VALID) ||
+	    peer_table_handles_get(peer->id, &handles)) {
+		return false;
+	}
+
+	/* A firmware update of the server may have moved its handles */
+	if (memcmp(handles.db_hash, peer->db_hash, sizeof(handles.db_hash))) {
+		LOG_INF("GATT database of server %d changed", peer->id);
+		peer_table_handles_clear(peer->id);
+		return false;
+	}
+
+	peer->client.conn = conn;
+	peer->client.handles.rx = handles.rx;
+	peer->client.handles.tx = handles.tx;
+	peer->client.handles.tx_ccc = handles.tx_ccc;
+	peer->client.tx_notif_params.subscribe = gatt_cache_subscribed;
+	peer->write_cmd = handles.write_cmd;
+
+	err = bt_nus_subscribe_receive(&peer->client);
+	if (err) {
+		LOG_WRN("Subscribing with the cached handles failed (err %d)", err);
+		peer_table_handles_clear(peer->id);
+		nus_client_reset(peer);
+		return false;
+	}
+
+	return true;
+}
+
+static uint8_t db_hash_read_cb(struct bt_conn *conn, uint8_t err,
+			       struct bt_gatt_read_params *params,
+			       const void *data, uint16_t length)
+{
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	if (!peer) {
+		return BT_GATT_ITER_STOP;
+	}
+
+	if (!err && data && (length == sizeof(peer->db_hash))) {
+		memcpy(peer->db_hash, data, sizeof(peer->db_hash));
+		peer->db_hash_state = DB_HASH_VALID;
+	} else {
+		peer->db_hash_state = DB_HASH_NONE;
+		LOG_INF("No Database Hash on server %d (err %u)", peer->id, err);
+	}
+
+	bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+
+	gatt_discover(conn);
+
+	return BT_GATT_ITER_STOP;
+}
+
+/*	Read the Database Hash of the server, it tells if the cached handles
+*	still hold. Returns false if the read did not start.
+*/
+static bool db_hash_read(struct bt_conn *conn, struct nus_peer *peer)
+{
+	int err;
+
+	peer->db_hash_read.func = db_hash_read_cb;
+	peer->db_hash_read.handle_count = 0;
+	peer->db_hash_read.by_uuid.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	peer->db_hash_read.by_uuid.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	peer->db_hash_read.by_uuid.uuid = BT_UUID_GATT_DB_HASH;
+
+	err = bt_gatt_read(conn, &peer->db_hash_read);
+	if (err) {
+		LOG_WRN("Database Hash read failed (err %d)", err);
+		peer->db_hash_state = DB_HASH_NONE;
+		return false;
+	}
+
+	peer->db_hash_state = DB_HASH_READING;
+
+	return true;
+}
+
+/*	Called after the link negotiation, and again when the security level
+*	changes. Only a peer whose handles are not known yet is discovered,
+*	after its Database Hash is read.
+*/
+static void gatt_discover(struct bt_conn *conn)
+{
+	bool discover = false;
+
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	if (!peer) {
+		return;
+	}
+
+	if (peer->client.conn) {
+		/* The handles are known already */
+	} else if ((peer->db_hash_state == DB_HASH_UNREAD) &&
+		   db_hash_read(conn, peer)) {
+		/* Continues in db_hash_read_cb() */
+	} else if (peer->db_hash_state != DB_HASH_READING) {
+		/* The handles come from the cache, or from a discovery */
+		discover = !gatt_cache_apply(conn, peer);
+	}
+
+	bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+
+	if (discover) {
+		discover_request(conn);
+	}
+}
+
+static void data_len_store(struct nus_peer *peer,
+			   const struct bt_conn_le_data_len_info *info)
+{
+	peer->tx_octets = info->tx_max_len;
+	peer->tx_time = info->tx_max_time;
+	peer->rx_octets = info->rx_max_len;
+	peer->rx_time = info->rx_max_time;
+}
+
+/*	The controller reports a data length change only, a link that keeps
+*	its data length goes on to the discovery after this time. The timers
+*	live outside the connection contexts and hold a reference to their
+*	connection, so a timeout never waits for a context that is being torn
+*	down, and it only finds the context again while it is still there.
+*/
+#define DATA_LEN_UPDATE_TIMEOUT K_MSEC(250)
+
+struct data_len_timer {
+	struct k_work_delayable work;
+	struct bt_conn *conn;
+};
+
+static struct data_len_timer data_len_timers[CONFIG_BT_MAX_CONN];
+
+/* Last step of the link negotiation, the NUS discovery follows */
+static void data_len_done(struct bt_conn *conn, struct nus_peer *peer)
+{
+	struct bt_conn_info info;
+	int err;
+
+	err = bt_conn_get_info(conn, &info);
+	if (!err && info.le.data_len) {
+		data_len_store(peer, info.le.data_len);
 	}
 
-	uart_rx_enable(uart, buf->data, sizeof(buf->data), UART_RX_TIMEOUT);
+	nus_peer_state_set(peer, NUS_PEER_DISCOVERING);
+	gatt_discover(conn);
 }
 
-//WRC
-static bool uart_test_async_api(const struct device *dev)
+static void data_len_timeout(struct k_work *item)
 {
-	const struct uart_driver_api *api =
-			(const struct uart_driver_api *)dev->api;
+	struct k_work_delayable *dwork = k_work_delayable_from_work(item);
+	struct data_len_timer *timer =
+		CONTAINER_OF(dwork, struct data_len_timer, work);
+	struct bt_conn *conn = timer->conn;
+	struct nus_peer *peer;
+
+	timer->conn = NULL;
+
+	/* The peer may be gone, or the update may have been reported */
+	peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+	if (peer) {
+		if (atomic_cas(&peer->data_len_pending, 1, 0)) {
+			LOG_INF("Data length of server %d unchanged", peer->id);
+			data_len_done(conn, peer);
+		}
 
-	return (api->callback_set != NULL);
+		bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+	}
+
+	bt_conn_unref(conn);
 }
 
-static int uart_init(void)
+/*	Second step of the link negotiation: ask the controller for the longest
+*	link layer packets. The NUS discovery starts when the result is
+*	reported in le_data_len_updated(), or right away when there is nothing
+*	to wait for.
+*/
+static void data_len_update(struct bt_conn *conn, struct nus_peer *peer)
 {
 	int err;
-	struct uart_data_t *rx;
-
-	if (!device_is_ready(uart)) {
-		LOG_ERR("UART device not ready");
-		return -ENODEV;
-	}
-	//WRC
 
-	if (IS_ENABLED(CONFIG_USB_DEVICE_STACK)) {
-		err = usb_enable(NULL);
-		if (err && (err != -EALREADY)) {
-			LOG_ERR("Failed to enable USB");
-			return err;
-		}
-	}
+	err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if (!err) {
+		struct data_len_timer *timer = &data_len_timers[bt_conn_index(conn)];
 
+		atomic_set(&peer->data_len_pending, 1);
 
-	rx = k_malloc(sizeof(*rx));
-	if (rx) {
-		rx->len = 0;
-	} else {
-		return -ENOMEM;
-	}
+		/* The timer is not cancelled, it finds nothing to do when the
+		 * update was reported in time.
+		 */
+		if (!timer->conn) {
+			timer->conn = bt_conn_ref(conn);
+			k_work_schedule(&timer->work, DATA_LEN_UPDATE_TIMEOUT);
+		}
 
-	k_work_init_delayable(&uart_work, uart_work_handler);
-	//WRC
-	
-	if (IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER) && !uart_test_async_api(uart)) {
-		/* Implement API adapter */
-		uart_async_adapter_init(async_adapter, uart);
-		uart = async_adapter;
+		return;
 	}
 
-	err = uart_callback_set(uart, uart_cb, NULL);
-	if (err) {
-		return err;
+	if (err != -EALREADY) {
+		LOG_WRN("Data length update request failed (err %d)", err);
 	}
 
-	return uart_rx_enable(uart, rx->data, sizeof(rx->data),
-			      UART_RX_TIMEOUT);
+	data_len_done(conn, peer);
 }
 
-static void discovery_complete(struct bt_gatt_dm *dm,
-			       void *context)
+static void mtu_exchange_cb(struct bt_conn *conn, uint8_t err,
+			    struct bt_gatt_exchange_params *params)
 {
-	struct bt_nus_client *nus = context;
-	LOG_INF("Service discovery completed");
-
-	bt_gatt_dm_data_print(dm);
+	char addr[BT_ADDR_LE_STR_LEN];
+	struct nus_peer *peer = CONTAINER_OF(params, struct nus_peer, mtu_params);
 
-	bt_nus_handles_assign(dm, nus);
-	bt_nus_subscribe_receive(nus);
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
-	bt_gatt_dm_data_release(dm);
+	peer->mtu = bt_gatt_get_mtu(conn);
 
-	int err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
 	if (err) {
-		LOG_ERR("Scanning failed to start (err %d)", err);
+		LOG_WRN("MTU exchange failed: %s (err %u), MTU %u",
+			addr, err, peer->mtu);
 	} else {
-		LOG_INF("Scanning started");
-	}
-
-	/*	Send a message to the new NUS server informing it of its ID in this 
-	*	mini-network
-	*	The new NUS will have been added to the connection context library and so
-	* 	will be the highest index as they are added incrementally upwards.
-	*	This is a bit of a workaround because in this function, I don't know
-	*	the ID of this connection which is the piece of info I want to transmit.
-	*/
-	size_t num_nus_conns = bt_conn_ctx_count(&conns_ctx_lib);
-	size_t nus_index = 99;
-
-	/*	This is a little inelegant but we must get the index of the device to
-	* 	convey it
-	*/
-	for (size_t i = 0; i < num_nus_conns; i++) {
-		const struct bt_conn_ctx *ctx =
-			bt_conn_ctx_get_by_id(&conns_ctx_lib, i);
-
-		if (ctx) {
-			if (ctx->data == nus) {
-				nus_index = i;
-				char message[3];
-				sprintf(message, "%d", nus_index);
-				message[2] = '\r';
-				int length = 3;
-
-				err = bt_nus_client_send(nus, message, length);
-				if (err) {
-					LOG_WRN("Failed to send data over BLE connection"
-						"(err %d)",
-						err);
-				} else {
-					LOG_INF("Sent to server %d: %s",
-						nus_index, message);
-				}
-
-				bt_conn_ctx_release(&conns_ctx_lib,
-						    (void *)ctx->data);
-				break;
-			} else {
-				bt_conn_ctx_release(&conns_ctx_lib,
-						    (void *)ctx->data);
-			}
-		}
+		LOG_INF("MTU exchanged: %s MTU %u", addr, peer->mtu);
 	}
-}
-
-static void discovery_service_not_found(struct bt_conn *conn,
-					void *context)
-{
-	LOG_INF("Service not found");
-}
 
-static void discovery_error(struct bt_conn *conn,
-			    int err,
-			    void *context)
-{
-	LOG_WRN("Error while discovering GATT database: (%d)", err);
+	data_len_update(conn, peer);
 }
 
-struct bt_gatt_dm_cb discovery_cb = {
-	.completed         = discovery_complete,
-	.service_not_found = discovery_service_not_found,
-	.error_found       = discovery_error,
-};
-
-static void gatt_discover(struct bt_conn *conn)
+/*	First step of the link negotiation that runs on every new connection
+*	before the peer is used for routing: exchange the ATT MTU.
+*/
+static void link_negotiate(struct bt_conn *conn, struct nus_peer *peer)
 {
 	int err;
 
-	struct bt_nus_client *nus_client =
-		bt_conn_ctx_get(&conns_ctx_lib, conn);
-
-	if (!nus_client) {
-		return;
-	}
+	nus_peer_state_set(peer, NUS_PEER_MTU_EXCHANGE);
+	peer->mtu_params.func = mtu_exchange_cb;
 
-	err = bt_gatt_dm_start(conn,
-			       BT_UUID_NUS_SERVICE,
-			       &discovery_cb,
-			       nus_client);
+	err = bt_gatt_exchange_mtu(conn, &peer->mtu_params);
 	if (err) {
-		LOG_ERR("could not start the discovery procedure, error "
-			"code: %d", err);
+		LOG_WRN("MTU exchange failed to start (err %d)", err);
+		peer->mtu = bt_gatt_get_mtu(conn);
+		data_len_update(conn, peer);
 	}
-
-	bt_conn_ctx_release(&conns_ctx_lib, (void *) nus_client);
-
 }
 
 static void connected(struct bt_conn *conn, uint8_t conn_err)
@@ -586,61 +2802,98 @@ static void connected(struct bt_conn *conn, uint8_t conn_err)
 */
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
+	/* The connection is no longer being initiated, the stack keeps its own
+	 * reference to an established connection.
+	 */
+	if (default_conn == conn) {
+		bt_conn_unref(default_conn);
+		default_conn = NULL;
+	}
+
 	if (conn_err) {
 		LOG_INF("Failed to connect to %s (%d)", addr,conn_err);
+		scan_resume();
+		return;
+	}
 
-		if (default_conn == conn) {
-			bt_conn_unref(default_conn);
-			default_conn = NULL;
+	LOG_INF("Connected: %s", addr);
 
-			err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
-			if (err) {
-				LOG_ERR("Scanning failed to start (err %d)",
-					err);
-			}
-		}
+	int id = peer_table_id_assign(bt_conn_get_dst(conn));
 
+	if (id < 0) {
+		LOG_WRN("No free peer ID for %s", addr);
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		scan_resume();
 		return;
 	}
 
-	LOG_INF("Connected: %s", addr);
-
 	/*Allocate memory for this connection using the connection context library. For reference,
 	this code was taken from hids.c
 	*/
-	struct bt_nus_client *nus_client =bt_conn_ctx_alloc(&conns_ctx_lib, conn);
+	struct nus_peer *peer = bt_conn_ctx_alloc(&conns_ctx_lib, conn);
 
-	if (!nus_client) {
+	if (!peer) {
 		LOG_WRN("There is no free memory to "
 			"allocate the connection context");
+		peer_table_release(id);
+		scan_resume();
+		return;
 	}
-	
-	struct bt_nus_client_init_param init = {
-		.cb = {
-			.received = ble_data_received,
-			.sent = ble_data_sent,
-		}
-	};
 
-	memset(nus_client, 0, bt_conn_ctx_block_size_get(&conns_ctx_lib));
+	memset(peer, 0, bt_conn_ctx_block_size_get(&conns_ctx_lib));
+	peer->id = id;
+	nus_peer_state_set(peer, NUS_PEER_CONNECTING);
+	peer->route.default_dest = ROUTE_DEST_NONE;
+	peer->uart_line_start = true;
+	peer->connected_at = k_uptime_get();
+	/* Once per connection, the window is sized at the end of the setup */
+	k_sem_init(&peer->tx_credits, 0, CONFIG_BT_NUS_TX_CREDITS);
+	k_msgq_init(&peer->tx_queue, peer->tx_queue_buf,
+		    sizeof(struct uart_data_t *), CONFIG_BT_NUS_PEER_TX_QUEUE_SIZE);
 
-	err = bt_nus_client_init(nus_client, &init);
+	err = bt_nus_client_init(&peer->client, &nus_client_init_param);
 
-	bt_conn_ctx_release(&conns_ctx_lib, (void *)nus_client);
-	
 	if (err) {
 		LOG_ERR("NUS Client initialization failed (err %d)", err);
 	}else{
 		LOG_INF("NUS Client module initialized");
 	}
 
-	gatt_discover(conn);
+	k_mutex_lock(&routes_lock, K_FOREVER);
+	routes[id] = peer;
+	k_mutex_unlock(&routes_lock);
+
+	LOG_INF("Server %d: %s", id, addr);
+
+	/* The network comes up again after all peers were gone */
+	if (!atomic_get(&peers_in_setup) && !atomic_get(&peers_ready)) {
+		bringup_start = peer->connected_at;
+	}
 
-	/*Stop scanning during the discovery*/
-	err = bt_scan_stop();
-	if ((!err) && (err != -EALREADY)) {
-		LOG_ERR("Stop LE scan failed (err %d)", err);
+	peer->in_setup = true;
+	atomic_inc(&peers_in_setup);
+
+	/*	A bonded peer gets its link encrypted with the keys of the bond
+	*	first, so the NUS is set up on a secure link. The link negotiation
+	*	follows in security_changed().
+	*/
+	if (IS_ENABLED(CONFIG_BT_NUS_SECURITY_ENABLED) &&
+	    bt_le_bond_exists(BT_ID_DEFAULT, bt_conn_get_dst(conn))) {
+		nus_peer_state_set(peer, NUS_PEER_SECURING);
+
+		err = bt_conn_set_security(conn, BT_SECURITY_L2);
+		if (err) {
+			LOG_WRN("Failed to set security: %d", err);
+			link_negotiate(conn, peer);
+		}
+	} else {
+		link_negotiate(conn, peer);
 	}
+
+	bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+
+	/* Keep scanning while this peer is set up */
+	scan_resume();
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason)
@@ -652,6 +2905,38 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 
 	LOG_INF("Disconnected: %s (reason %u)", addr,reason);
 
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	if (peer) {
+		uint8_t id = peer->id;
+
+		nus_peer_state_set(peer, NUS_PEER_DISCONNECTING);
+
+		/* Take the peer out of the routes before its queue is emptied */
+		k_mutex_lock(&routes_lock, K_FOREVER);
+		routes[id] = NULL;
+		k_mutex_unlock(&routes_lock);
+
+		/* The host router may be waiting for room in this queue */
+		k_sem_give(&host_port_of(id)->tx_space);
+
+		if (atomic_get(&peer->flow_xoff)) {
+			atomic_dec(&uart_flow_xoff_peers);
+		}
+
+		if (peer->ready) {
+			atomic_dec(&peers_ready);
+		}
+
+		peer_setup_end(peer, false);
+
+		nus_peer_tx_flush(peer);
+		nus_peer_state_set(peer, NUS_PEER_DISCONNECTED);
+		bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+
+		peer_table_release(id);
+	}
+
 	err = bt_conn_ctx_free(&conns_ctx_lib, conn);
 
 	if (err) {
@@ -659,14 +2944,11 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 			"connection.");
 	}
 
-	bt_conn_unref(conn);
-	default_conn = NULL;
+	/* Its discovery is not going to run any more */
+	discover_cancel(conn);
 
-	// err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
-	// if (err) {
-	// 	LOG_ERR("Scanning failed to start (err %d)",
-	// 		err);
-	// }
+	/* The connection slot and maybe a setup slot are free again */
+	scan_resume();
 }
 
 static void security_changed(struct bt_conn *conn, bt_security_t level,
@@ -682,13 +2964,59 @@ static void security_changed(struct bt_conn *conn, bt_security_t level,
 		LOG_WRN("Security failed: %s level %u err %d", addr,level, err);
 	}
 
-	gatt_discover(conn);
+	/* Discovery is started by the link negotiation, unless it already
+	 * finished before the security level changed.
+	 */
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	if (!peer) {
+		return;
+	}
+
+	bool securing = (nus_peer_state_get(peer->id) == NUS_PEER_SECURING);
+	bool negotiated = (peer->mtu != 0);
+
+	/* Go on without encryption if it failed, the server may not need it */
+	if (securing) {
+		link_negotiate(conn, peer);
+	}
+
+	bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+
+	if (!securing && negotiated) {
+		gatt_discover(conn);
+	}
+}
+
+static void le_data_len_updated(struct bt_conn *conn,
+				struct bt_conn_le_data_len_info *info)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+	LOG_INF("Data length updated: %s TX %u bytes/%u us, RX %u bytes/%u us",
+		addr, info->tx_max_len, info->tx_max_time,
+		info->rx_max_len, info->rx_max_time);
+
+	if (peer) {
+		data_len_store(peer, info);
+
+		/* The negotiation waited for this update */
+		if (atomic_cas(&peer->data_len_pending, 1, 0)) {
+			data_len_done(conn, peer);
+		}
+
+		bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+	}
 }
 
 static struct bt_conn_cb conn_callbacks = {
 	.connected = connected,
 	.disconnected = disconnected,
-	.security_changed = security_changed
+	.security_changed = security_changed,
+	.le_data_len_updated = le_data_len_updated
 };
 
 static void scan_filter_match(struct bt_scan_device_info *device_info,
@@ -705,6 +3033,9 @@ static void scan_filter_match(struct bt_scan_device_info *device_info,
 static void scan_connecting_error(struct bt_scan_device_info *device_info)
 {
 	LOG_WRN("Connecting failed");
+
+	/* The scan module stopped scanning to connect */
+	scan_resume();
 }
 
 static void scan_connecting(struct bt_scan_device_info *device_info,
@@ -736,15 +3067,42 @@ static void scan_connecting(struct bt_scan_device_info *device_info,
 BT_SCAN_CB_INIT(scan_cb, scan_filter_match, NULL,
 		scan_connecting_error, scan_connecting);
 
-static int scan_init(void)
+/*	The scan window covers the whole interval, so a bonded server that
+*	drops is connected again at its first advertisement. Duplicates are
+*	not filtered, so a failed connection is retried at the next one.
+*/
+static const struct bt_le_scan_param scan_param = {
+	.type = BT_LE_SCAN_TYPE_ACTIVE,
+	.options = BT_LE_SCAN_OPT_NONE,
+	.interval = BT_GAP_SCAN_FAST_INTERVAL,
+	.window = BT_GAP_SCAN_FAST_INTERVAL,
+};
+
+static void scan_bond_add(const struct bt_bond_info *info, void *user_data)
 {
+	int *bonds = user_data;
 	int err;
-	struct bt_scan_init_param scan_init = {
-		.connect_if_match = 1,
-	};
 
-	bt_scan_init(&scan_init);
-	bt_scan_cb_register(&scan_cb);
+	err = bt_scan_filter_add(BT_SCAN_FILTER_TYPE_ADDR, &info->addr);
+	if (err) {
+		LOG_WRN("Bonded server not added to the filters (err %d)", err);
+		return;
+	}
+
+	(*bonds)++;
+}
+
+/*	New servers are found by the NUS UUID in their advertisements. Bonded
+*	servers are also matched by their identity address, so they reconnect
+*	whatever they advertise. Any matching filter starts the connection.
+*/
+static int scan_filters_update(void)
+{
+	uint8_t mode = BT_SCAN_UUID_FILTER;
+	int bonds = 0;
+	int err;
+
+	bt_scan_filter_remove_all();
 
 	err = bt_scan_filter_add(BT_SCAN_FILTER_TYPE_UUID, BT_UUID_NUS_SERVICE);
 	if (err) {
@@ -752,12 +3110,37 @@ static int scan_init(void)
 		return err;
 	}
 
-	err = bt_scan_filter_enable(BT_SCAN_UUID_FILTER, false);
+	bt_foreach_bond(BT_ID_DEFAULT, scan_bond_add, &bonds);
+	if (bonds) {
+		mode |= BT_SCAN_ADDR_FILTER;
+	}
+
+	err = bt_scan_filter_enable(mode, false);
 	if (err) {
 		LOG_ERR("Filters cannot be turned on (err %d)", err);
 		return err;
 	}
 
+	LOG_INF("Scanning for NUS servers and %d bonded servers", bonds);
+	return 0;
+}
+
+static int scan_init(void)
+{
+	int err;
+	struct bt_scan_init_param scan_init = {
+		.scan_param = &scan_param,
+		.connect_if_match = 1,
+	};
+
+	bt_scan_init(&scan_init);
+	bt_scan_cb_register(&scan_cb);
+
+	err = scan_filters_update();
+	if (err) {
+		return err;
+	}
+
 	LOG_INF("Scan module initialized");
 	return err;
 }
@@ -792,6 +3175,21 @@ static void pairing_complete(struct bt_conn *conn, bool bonded)
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
 	LOG_INF("Pairing completed: %s, bonded: %d", addr,bonded);
+
+	if (!bonded) {
+		return;
+	}
+
+	/* Keep the ID of a bonded peer, bound to its identity address */
+	struct nus_peer *peer = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+	if (peer) {
+		peer_table_persist(peer->id, bt_conn_get_dst(conn));
+		bt_conn_ctx_release(&conns_ctx_lib, (void *)peer);
+	}
+
+	/* Reconnect it as soon as it drops */
+	scan_filters_update();
 }
 
 
@@ -804,6 +3202,26 @@ static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason)
 	LOG_WRN("Pairing failed conn: %s, reason %d", addr,	reason);
 }
 
+static void bond_deleted(uint8_t id, const bt_addr_le_t *peer)
+{
+	int peer_id = peer_table_id_find(peer);
+
+	scan_filters_update();
+
+	if (peer_id < 0) {
+		return;
+	}
+
+	peer_table_forget(peer_id);
+
+	/* A connected peer keeps its ID until it disconnects */
+	k_mutex_lock(&routes_lock, K_FOREVER);
+	if (!routes[peer_id]) {
+		peer_table_release(peer_id);
+	}
+	k_mutex_unlock(&routes_lock);
+}
+
 static struct bt_conn_auth_cb conn_auth_callbacks = {
 	.cancel = auth_cancel,
 	.pairing_confirm = pairing_confirm
@@ -811,11 +3229,139 @@ static struct bt_conn_auth_cb conn_auth_callbacks = {
 
 static struct bt_conn_auth_info_cb conn_auth_info_callbacks = {
 	.pairing_complete = pairing_complete,
-	.pairing_failed = pairing_failed
+	.pairing_failed = pairing_failed,
+	.bond_deleted = bond_deleted
 };
 
 
 
+/*	Answer a command on the host port it came from: a line that starts
+*	with the central's routing header, or a DATA frame from CENTRAL_INDEX.
+*/
+#define CENTRAL_REPLY_MAX 32
+
+static void central_reply(struct host_port *port, const char *text)
+{
+	uint8_t frame[UART_FRAME_ENCODED_MAX(CENTRAL_REPLY_MAX)];
+	char hdr[sizeof("*00")];
+	struct uart_tx_seg segs[2];
+	size_t count = 0;
+	uint16_t len = MIN(strlen(text), CENTRAL_REPLY_MAX);
+
+	if (atomic_get(&port->framing)) {
+		segs[count].data = frame;
+		segs[count].len = uart_frame_encode(UART_FRAME_DATA, CENTRAL_INDEX,
+						    text, len, frame);
+		count++;
+	} else {
+		segs[count].data = hdr;
+		segs[count].len = snprintf(hdr, sizeof(hdr), "%c%02d",
+					   ROUTED_MESSAGE_CHAR, CENTRAL_INDEX);
+		count++;
+		segs[count].data = text;
+		segs[count].len = len;
+		count++;
+	}
+
+	if (uart_tx_write(port, segs, count, UART_TX_SRC_NONE, false)) {
+		LOG_WRN("UART TX ring full, command reply dropped");
+	}
+}
+
+/*	Commands from the host to the central itself, sent as routed messages
+*	to CENTRAL_INDEX, for example "*98mirror on". They apply to the host
+*	port they come from, except "port NN P" that moves peer NN to port P.
+*	"state NN" is answered with the setup state of peer NN.
+*/
+static void central_command(struct host_port *port, const uint8_t *data,
+			    uint16_t len)
+{
+	char cmd[32];
+	unsigned int id;
+	unsigned int index;
+
+	/* Drop the line end */
+	while (len && ((data[len - 1] == '\n') || (data[len - 1] == '\r'))) {
+		len--;
+	}
+
+	len = MIN(len, sizeof(cmd) - 1);
+	memcpy(cmd, data, len);
+	cmd[len] = '\0';
+
+	if (!strcmp(cmd, "mirror on")) {
+		atomic_set(&port->mirror, 1);
+	} else if (!strcmp(cmd, "mirror off")) {
+		atomic_set(&port->mirror, 0);
+	} else if (!strcmp(cmd, "tag on")) {
+		atomic_set(&port->tag, 1);
+	} else if (!strcmp(cmd, "tag off")) {
+		atomic_set(&port->tag, 0);
+	} else if (uart_framing_command(cmd, len) >= 0) {
+		/* Already switched by the UART receiver */
+	} else if ((sscanf(cmd, "port %u %u", &id, &index) == 2) &&
+		   (id < PEER_TABLE_SIZE) && (index < HOST_PORT_COUNT)) {
+		struct host_port *old = host_port_of(id);
+
+		atomic_set(&peer_ports[id], index);
+		/* Its router may be waiting for room in the peer's queue */
+		k_sem_give(&old->tx_space);
+	} else if ((sscanf(cmd, "state %u", &id) == 1) &&
+		   (id < PEER_TABLE_SIZE)) {
+		char reply[CENTRAL_REPLY_MAX];
+
+		snprintf(reply, sizeof(reply), "%02u %s\r\n", id,
+			 nus_peer_state_names[nus_peer_state_get(id)]);
+		central_reply(port, reply);
+	} else {
+		LOG_WRN("Unknown command \"%s\"", cmd);
+		return;
+	}
+
+	LOG_INF("Command \"%s\" done", cmd);
+}
+
+/*	Route the messages from one host port to the peers. A router waits for
+*	room in the peer queues, so each port has its own and a saturated port
+*	only slows down itself.
+*/
+static void host_router(struct host_port *port)
+{
+	for (;;) {
+		/* Wait indefinitely for data to be sent over Bluetooth */
+		struct uart_data_t *buf = k_fifo_get(&port->rx_fifo, K_FOREVER);
+
+		uart_flow_update(port, atomic_dec(&port->rx_queued) - 1);
+
+		uint16_t hdr_len = 0;
+		int dest;
+
+		if (buf->framed) {
+			dest = buf->dest;
+		} else {
+			dest = route_parse(&port->route, &buf->data[buf->off],
+					   buf->len, &hdr_len);
+		}
+
+		/* The header is skipped, not moved out of the buffer */
+		buf->off += hdr_len;
+		buf->len -= hdr_len;
+
+		if (dest == CENTRAL_INDEX) {
+			central_command(port, &buf->data[buf->off], buf->len);
+		}
+
+		multi_nus_send(buf, dest, port);
+	}
+}
+
+#if HOST_PORT_COUNT > 1
+static void host_router_thread(void *p1, void *p2, void *p3)
+{
+	host_router(p1);
+}
+#endif
+
 int main(void)
 {
 	int err;
@@ -843,6 +3389,10 @@ int main(void)
 		settings_load();
 	}
 
+	for (size_t i = 0; i < ARRAY_SIZE(data_len_timers); i++) {
+		k_work_init_delayable(&data_len_timers[i].work, data_len_timeout);
+	}
+
 	bt_conn_cb_register(&conn_callbacks);
 
 	int (*module_init[])(void) = {uart_init, scan_init};//, nus_client_init};
@@ -855,6 +3405,7 @@ int main(void)
 
 	printk("Starting Bluetooth Central UART example\n");
 
+	bringup_start = k_uptime_get();
 
 	err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
 	if (err) {
@@ -864,12 +3415,21 @@ int main(void)
 
 	LOG_INF("Scanning successfully started");
 
-	for (;;) {
-		/* Wait indefinitely for data to be sent over Bluetooth */
-		struct uart_data_t *buf = k_fifo_get(&fifo_uart_rx_data,
-						     K_FOREVER);
+	if (CONFIG_BT_NUS_STATS_INTERVAL > 0) {
+		k_work_init_delayable(&stats_work, stats_work_handler);
+		k_work_schedule(&stats_work, K_SECONDS(CONFIG_BT_NUS_STATS_INTERVAL));
+	}
 
-		multi_nus_send(buf);					
-		
+#if HOST_PORT_COUNT > 1
+	for (size_t i = 1; i < HOST_PORT_COUNT; i++) {
+		k_thread_create(&host_router_threads[i - 1], host_router_stacks[i - 1],
+				K_THREAD_STACK_SIZEOF(host_router_stacks[i - 1]),
+				host_router_thread, &host_ports[i], NULL, NULL,
+				CONFIG_MAIN_THREAD_PRIORITY, 0, K_NO_WAIT);
 	}
-}
\ No newline at end of file
+#endif
+
+	host_router(&host_ports[0]);
+
+	return 0;
+}
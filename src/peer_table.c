@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) Multi-NUS Central contributors
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+/** @file
+ *  @brief Stable peer ID table
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <zephyr/logging/log.h>
+
+#include "peer_table.h"
+
+LOG_MODULE_REGISTER(peer_table, LOG_LEVEL_INF);
+
+#define PEER_TABLE_SETTINGS_ROOT "nus_peer"
+/* Key of the cached handles, under the key of the entry */
+#define PEER_TABLE_HANDLES_KEY "hdl"
+
+/* The stored handles have a fixed layout, independent of the compiler and
+ * of struct peer_table_handles. A record of another version is ignored and
+ * the peer is discovered again.
+ */
+#define PEER_TABLE_HANDLES_VERSION 1
+#define PEER_TABLE_HANDLES_WRITE_CMD BIT(0)
+
+struct peer_handles_record {
+	uint8_t version;
+	uint8_t flags;
+	/* Little endian */
+	uint16_t rx;
+	uint16_t tx;
+	uint16_t tx_ccc;
+	uint8_t db_hash[PEER_TABLE_DB_HASH_LEN];
+} __packed;
+
+struct peer_entry {
+	bt_addr_le_t addr;
+	struct peer_table_handles handles;
+	bool used;
+	bool persistent;
+	bool handles_valid;
+};
+
+static struct peer_entry peers[PEER_TABLE_SIZE];
+static K_MUTEX_DEFINE(peers_lock);
+
+/* Entries that have to be written to or deleted from the settings. */
+static ATOMIC_DEFINE(peers_dirty, PEER_TABLE_SIZE);
+
+static void save_work_handler(struct k_work *item);
+
+static K_WORK_DEFINE(save_work, save_work_handler);
+
+static void save_work_handler(struct k_work *item)
+{
+	char name[sizeof(PEER_TABLE_SETTINGS_ROOT "/00/" PEER_TABLE_HANDLES_KEY)];
+	struct peer_table_handles handles;
+	struct peer_handles_record record;
+	bt_addr_le_t addr;
+	bool store;
+	bool store_handles;
+	int err;
+
+	for (int id = 0; id < PEER_TABLE_SIZE; id++) {
+		if (!atomic_test_and_clear_bit(peers_dirty, id)) {
+			continue;
+		}
+
+		k_mutex_lock(&peers_lock, K_FOREVER);
+		store = peers[id].used && peers[id].persistent;
+		store_handles = store && peers[id].handles_valid;
+		bt_addr_le_copy(&addr, &peers[id].addr);
+		handles = peers[id].handles;
+		k_mutex_unlock(&peers_lock);
+
+		snprintf(name, sizeof(name), PEER_TABLE_SETTINGS_ROOT "/%d", id);
+
+		if (store) {
+			err = settings_save_one(name, &addr, sizeof(addr));
+		} else {
+			err = settings_delete(name);
+		}
+
+		if (err) {
+			LOG_ERR("Failed to update peer ID %d (err %d)", id, err);
+		}
+
+		snprintf(name, sizeof(name),
+			 PEER_TABLE_SETTINGS_ROOT "/%d/" PEER_TABLE_HANDLES_KEY, id);
+
+		if (store_handles) {
+			record.version = PEER_TABLE_HANDLES_VERSION;
+			record.flags = handles.write_cmd ? PEER_TABLE_HANDLES_WRITE_CMD : 0;
+			record.rx = sys_cpu_to_le16(handles.rx);
+			record.tx = sys_cpu_to_le16(handles.tx);
+			record.tx_ccc = sys_cpu_to_le16(handles.tx_ccc);
+			memcpy(record.db_hash, handles.db_hash, sizeof(record.db_hash));
+
+			err = settings_save_one(name, &record, sizeof(record));
+		} else {
+			err = settings_delete(name);
+		}
+
+		if (err) {
+			LOG_ERR("Failed to update the handles of peer ID %d (err %d)",
+				id, err);
+		}
+	}
+}
+
+static void peer_mark_dirty(uint8_t id)
+{
+	if (IS_ENABLED(CONFIG_SETTINGS)) {
+		atomic_set_bit(peers_dirty, id);
+		k_work_submit(&save_work);
+	}
+}
+
+static int peer_find(const bt_addr_le_t *addr)
+{
+	for (int id = 0; id < PEER_TABLE_SIZE; id++) {
+		if (peers[id].used && bt_addr_le_eq(&peers[id].addr, addr)) {
+			return id;
+		}
+	}
+
+	return -ENOENT;
+}
+
+int peer_table_id_find(const bt_addr_le_t *addr)
+{
+	int id;
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+	id = peer_find(addr);
+	k_mutex_unlock(&peers_lock);
+
+	return id;
+}
+
+int peer_table_id_assign(const bt_addr_le_t *addr)
+{
+	int id;
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+
+	id = peer_find(addr);
+	if (id < 0) {
+		id = -ENOMEM;
+
+		for (int i = 0; i < PEER_TABLE_SIZE; i++) {
+			if (!peers[i].used) {
+				bt_addr_le_copy(&peers[i].addr, addr);
+				peers[i].used = true;
+				peers[i].persistent = false;
+				peers[i].handles_valid = false;
+				id = i;
+				break;
+			}
+		}
+	}
+
+	k_mutex_unlock(&peers_lock);
+
+	return id;
+}
+
+void peer_table_persist(uint8_t id, const bt_addr_le_t *addr)
+{
+	int old;
+
+	if (id >= PEER_TABLE_SIZE) {
+		return;
+	}
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+
+	/* A peer that connected with a private address may already own an
+	 * entry under its identity address, keep only the new binding.
+	 */
+	old = peer_find(addr);
+	if ((old >= 0) && (old != id)) {
+		peers[old].used = false;
+		peers[old].persistent = false;
+		peers[old].handles_valid = false;
+		peer_mark_dirty(old);
+	}
+
+	bt_addr_le_copy(&peers[id].addr, addr);
+	peers[id].used = true;
+	peers[id].persistent = true;
+
+	k_mutex_unlock(&peers_lock);
+
+	peer_mark_dirty(id);
+}
+
+void peer_table_forget(uint8_t id)
+{
+	bool persistent;
+
+	if (id >= PEER_TABLE_SIZE) {
+		return;
+	}
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+	persistent = peers[id].persistent;
+	peers[id].persistent = false;
+	peers[id].handles_valid = false;
+	k_mutex_unlock(&peers_lock);
+
+	if (persistent) {
+		peer_mark_dirty(id);
+	}
+}
+
+void peer_table_release(uint8_t id)
+{
+	if (id >= PEER_TABLE_SIZE) {
+		return;
+	}
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+	if (!peers[id].persistent) {
+		peers[id].used = false;
+		peers[id].handles_valid = false;
+	}
+	k_mutex_unlock(&peers_lock);
+}
+
+int peer_table_handles_get(uint8_t id, struct peer_table_handles *handles)
+{
+	int err = -ENOENT;
+
+	if (id >= PEER_TABLE_SIZE) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+	if (peers[id].used && peers[id].persistent && peers[id].handles_valid) {
+		*handles = peers[id].handles;
+		err = 0;
+	}
+	k_mutex_unlock(&peers_lock);
+
+	return err;
+}
+
+void peer_table_handles_set(uint8_t id, const struct peer_table_handles *handles)
+{
+	bool persistent;
+
+	if (id >= PEER_TABLE_SIZE) {
+		return;
+	}
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+	peers[id].handles = *handles;
+	peers[id].handles_valid = true;
+	persistent = peers[id].persistent;
+	k_mutex_unlock(&peers_lock);
+
+	/* The handles of a peer without a bond are stored if it bonds */
+	if (persistent) {
+		peer_mark_dirty(id);
+	}
+}
+
+void peer_table_handles_clear(uint8_t id)
+{
+	bool stored;
+
+	if (id >= PEER_TABLE_SIZE) {
+		return;
+	}
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+	stored = peers[id].persistent && peers[id].handles_valid;
+	peers[id].handles_valid = false;
+	k_mutex_unlock(&peers_lock);
+
+	if (stored) {
+		peer_mark_dirty(id);
+	}
+}
+
+#if IS_ENABLED(CONFIG_SETTINGS)
+static int peer_table_set(const char *name, size_t len,
+			  settings_read_cb read_cb, void *cb_arg)
+{
+	struct peer_handles_record record;
+	bt_addr_le_t addr;
+	unsigned long id;
+	char *end;
+	ssize_t rc;
+
+	id = strtoul(name, &end, 10);
+	if ((end == name) || (id >= PEER_TABLE_SIZE)) {
+		LOG_WRN("Ignoring stored peer \"%s\"", name);
+		return 0;
+	}
+
+	if (!strcmp(end, "/" PEER_TABLE_HANDLES_KEY)) {
+		if (len != sizeof(record)) {
+			LOG_WRN("Ignoring stored handles of peer ID %lu", id);
+			return 0;
+		}
+
+		rc = read_cb(cb_arg, &record, sizeof(record));
+		if (rc < 0) {
+			return rc;
+		}
+
+		if (record.version != PEER_TABLE_HANDLES_VERSION) {
+			LOG_WRN("Ignoring stored handles of peer ID %lu", id);
+			return 0;
+		}
+
+		k_mutex_lock(&peers_lock, K_FOREVER);
+		peers[id].handles.rx = sys_le16_to_cpu(record.rx);
+		peers[id].handles.tx = sys_le16_to_cpu(record.tx);
+		peers[id].handles.tx_ccc = sys_le16_to_cpu(record.tx_ccc);
+		peers[id].handles.write_cmd =
+			(record.flags & PEER_TABLE_HANDLES_WRITE_CMD) != 0;
+		memcpy(peers[id].handles.db_hash, record.db_hash,
+		       sizeof(record.db_hash));
+		peers[id].handles_valid = true;
+		k_mutex_unlock(&peers_lock);
+
+		return 0;
+	}
+
+	if (*end != '\0') {
+		LOG_WRN("Ignoring stored peer \"%s\"", name);
+		return 0;
+	}
+
+	if (len != sizeof(addr)) {
+		return -EINVAL;
+	}
+
+	rc = read_cb(cb_arg, &addr, sizeof(addr));
+	if (rc < 0) {
+		return rc;
+	}
+
+	k_mutex_lock(&peers_lock, K_FOREVER);
+	bt_addr_le_copy(&peers[id].addr, &addr);
+	peers[id].used = true;
+	peers[id].persistent = true;
+	k_mutex_unlock(&peers_lock);
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(peer_table, PEER_TABLE_SETTINGS_ROOT, NULL,
+			       peer_table_set, NULL, NULL);
+#endif /* IS_ENABLED(CONFIG_SETTINGS) */
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) Multi-NUS Central contributors
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+/** @file
+ *  @brief Stable peer ID table
+ */
+
+#ifndef PEER_TABLE_H_
+#define PEER_TABLE_H_
+
+/**
+ * @brief Stable peer ID table
+ * @defgroup peer_table Peer ID table
+ * @{
+ *
+ * This module binds peer addresses to fixed routing IDs. The IDs of bonded
+ * peers are stored with the settings subsystem, so a peer keeps its ID
+ * across reconnects and reboots. Peers without a bond hold their ID only
+ * while they are connected.
+ *
+ * The table also caches the NUS handles of each peer. The handles of
+ * bonded peers are stored with their IDs, so a reconnecting peer can be
+ * set up without a GATT discovery. They are stored with the Database Hash
+ * of the peer, which tells if its GATT database changed since.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/bluetooth/addr.h>
+
+/** Number of peer IDs, the valid IDs are 0 to PEER_TABLE_SIZE - 1 */
+#define PEER_TABLE_SIZE CONFIG_BT_NUS_PEER_TABLE_SIZE
+
+/** Length of the Database Hash of a GATT server */
+#define PEER_TABLE_DB_HASH_LEN 16
+
+/** NUS handles found by the discovery of a peer */
+struct peer_table_handles {
+	/** Value handle of the RX characteristic */
+	uint16_t rx;
+	/** Value handle of the TX characteristic */
+	uint16_t tx;
+	/** Handle of the CCC descriptor of the TX characteristic */
+	uint16_t tx_ccc;
+	/** The RX characteristic accepts Write Without Response */
+	bool write_cmd;
+	/** Database Hash of the peer when the handles were found */
+	uint8_t db_hash[PEER_TABLE_DB_HASH_LEN];
+};
+
+/**
+ * @brief Get the ID bound to a peer address, binding a free ID if needed
+ *
+ * @param addr Peer address
+ *
+ * @retval ID of the peer
+ * @retval -ENOMEM No free ID left in the table
+ */
+int peer_table_id_assign(const bt_addr_le_t *addr);
+
+/**
+ * @brief Get the ID bound to a peer address
+ *
+ * @param addr Peer address
+ *
+ * @retval ID of the peer
+ * @retval -ENOENT The address is not in the table
+ */
+int peer_table_id_find(const bt_addr_le_t *addr);
+
+/**
+ * @brief Store the binding of a bonded peer
+ *
+ * The address is updated, so the identity address resolved during pairing
+ * replaces the address used when the peer connected. The entry is saved
+ * with the settings subsystem.
+ *
+ * @param id   Peer ID
+ * @param addr Peer identity address
+ */
+void peer_table_persist(uint8_t id, const bt_addr_le_t *addr);
+
+/**
+ * @brief Drop the stored binding of a peer
+ *
+ * The entry is deleted from the settings. The ID stays in use until it is
+ * released with @ref peer_table_release.
+ *
+ * @param id Peer ID
+ */
+void peer_table_forget(uint8_t id);
+
+/**
+ * @brief Release a peer ID that is not bound to a bonded peer
+ *
+ * Call this when the peer disconnects. The IDs of bonded peers are kept.
+ *
+ * @param id Peer ID
+ */
+void peer_table_release(uint8_t id);
+
+/**
+ * @brief Get the cached NUS handles of a bonded peer
+ *
+ * @param id      Peer ID
+ * @param handles Output
+ *
+ * @retval 0 The handles are cached
+ * @retval -ENOENT The peer is not bonded or its handles are not known
+ * @retval -EINVAL Invalid ID
+ */
+int peer_table_handles_get(uint8_t id, struct peer_table_handles *handles);
+
+/**
+ * @brief Cache the NUS handles of a peer
+ *
+ * The handles are stored with the settings once the peer is bonded, and
+ * dropped with its ID.
+ *
+ * @param id      Peer ID
+ * @param handles Handles found by the discovery
+ */
+void peer_table_handles_set(uint8_t id, const struct peer_table_handles *handles);
+
+/**
+ * @brief Drop the cached NUS handles of a peer
+ *
+ * Call this when the cached handles turn out to be wrong.
+ *
+ * @param id Peer ID
+ */
+void peer_table_handles_clear(uint8_t id);
+
+/** @} */
+
+#endif /* PEER_TABLE_H_ */
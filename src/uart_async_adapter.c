@@ -10,6 +10,7 @@
 #include "uart_async_adapter.h"
 #include <zephyr/drivers/uart.h>
 #include <zephyr/sys/__assert.h>
+#include <string.h>
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(uart_async_adapter);
@@ -23,6 +24,50 @@ LOG_MODULE_REGISTER(uart_async_adapter);
 #error "The adapter requires UART INTERRUPT API to be enabled"
 #endif
 
+/* Bytes read from the FIFO in one go when there is no buffer to fill */
+#define RX_DROP_CHUNK 32
+
+/* The counters are only changed under data->lock. STATS_BYTES_ADD() is used
+ * where the lock is already held, the other macros take it.
+ */
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_STATS)
+#define STATS_IRQ_ENTER(_start) uint32_t _start = k_cycle_get_32()
+#define STATS_IRQ_EXIT(_data, _start) do { \
+		uint32_t _cycles = k_cycle_get_32() - (_start); \
+		k_spinlock_key_t _key = k_spin_lock(&(_data)->lock); \
+		(_data)->stats.cycles += _cycles; \
+		(_data)->stats.irqs++; \
+		k_spin_unlock(&(_data)->lock, _key); \
+	} while (0)
+#define STATS_BYTES_ADD(_data, _n) ((_data)->stats.bytes += (_n))
+#define STATS_BYTES_ADD_LOCKED(_data, _n) do { \
+		k_spinlock_key_t _key = k_spin_lock(&(_data)->lock); \
+		(_data)->stats.bytes += (_n); \
+		k_spin_unlock(&(_data)->lock, _key); \
+	} while (0)
+#else
+#define STATS_IRQ_ENTER(_start)
+#define STATS_IRQ_EXIT(_data, _start) do { } while (0)
+#define STATS_BYTES_ADD(_data, _n) ((void)(_n))
+#define STATS_BYTES_ADD_LOCKED(_data, _n) ((void)(_n))
+#endif
+
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+#define RX_RING_SIZE CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING_SIZE
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+
+BUILD_ASSERT(IS_POWER_OF_TWO(RX_RING_SIZE), "RX ring size must be a power of two");
+
+/* The ring consumers of all the adapters run here, one priority above the
+ * system work queue.
+ */
+#define RX_RING_WORKQ_PRIORITY K_PRIO_COOP(CONFIG_NUM_COOP_PRIORITIES - 2)
+
+static K_THREAD_STACK_DEFINE(rx_ring_workq_stack,
+			     CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING_STACK_SIZE);
+static struct k_work_q rx_ring_workq;
+#endif
+
 
 /**
  * @brief Access the data inside device
@@ -139,6 +184,137 @@ static inline void switch_rx_buffer(const struct device *dev, bool request_new)
 	}
 }
 
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+/**
+ * @brief Move the data from the RX ring into the user buffers
+ *
+ * This is the only reader of the ring and the only writer of the current
+ * buffer position, so it works without the lock taken by the interrupt
+ * handler in the default mode. Runs in thread context.
+ *
+ * @param dev         Adapter device
+ * @param flush       Notify the moved data even if the buffer is not full
+ * @param request_new Request a new buffer when the current one is full
+ */
+static void rx_ring_consume(const struct device *dev, bool flush, bool request_new)
+{
+	struct uart_async_adapter_data *data = access_dev_data(dev);
+	atomic_val_t tail = atomic_get(&data->rx.ring.tail);
+	atomic_val_t head;
+	size_t dropped = 0;
+	size_t len;
+
+	while ((head = atomic_get(&data->rx.ring.head)) != tail) {
+		if (!data->rx.size_left) {
+			notify_rx_buffer(dev);
+			switch_rx_buffer(dev, request_new);
+		}
+		if (!data->rx.size_left) {
+			/* Data received without buffer - dropping */
+			dropped += head - tail;
+			tail = head;
+		} else {
+			len = MIN((size_t)(head - tail), data->rx.size_left);
+			len = MIN(len, RX_RING_SIZE - (tail & RX_RING_MASK));
+			memcpy(data->rx.curr_buf, &data->rx.ring.buf[tail & RX_RING_MASK], len);
+			data->rx.curr_buf += len;
+			data->rx.size_left -= len;
+			tail += len;
+		}
+		/* Give the space back to the interrupt handler */
+		atomic_set(&data->rx.ring.tail, tail);
+	}
+
+	if (dropped) {
+		LOG_ERR("Data received without buffer prepared, dropped %u bytes", dropped);
+	}
+	if (flush || (data->rx.timeout == 0)) {
+		notify_rx_buffer(dev);
+	}
+}
+
+static void rx_ring_submit(struct uart_async_adapter_data *data)
+{
+	k_work_submit_to_queue(&rx_ring_workq, &data->rx.ring.work);
+}
+
+/**
+ * @brief Finish disabling the reception in the consumer context
+ *
+ * The data left in the ring is handed over before the buffers are
+ * released.
+ *
+ * @param dev Adapter device
+ */
+static void rx_ring_disable(const struct device *dev)
+{
+	struct uart_async_adapter_data *data = access_dev_data(dev);
+	struct uart_event event_disabled = {UART_RX_DISABLED};
+
+	rx_ring_consume(dev, true, false);
+	while (data->rx.buf || data->rx.next_buf) {
+		switch_rx_buffer(dev, false);
+	}
+
+	user_callback(dev, &event_disabled);
+}
+
+static void rx_ring_work_handler(struct k_work *work)
+{
+	struct uart_async_adapter_data *data =
+		CONTAINER_OF(work, struct uart_async_adapter_data, rx.ring.work);
+
+	if (atomic_clear(&data->rx.ring.disable)) {
+		rx_ring_disable(data->rx.ring.dev);
+		return;
+	}
+
+	rx_ring_consume(data->rx.ring.dev, atomic_clear(&data->rx.ring.flush),
+			data->rx.enabled);
+}
+#endif /* IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING) */
+
+#define TX_QUEUE_SIZE CONFIG_BT_NUS_UART_ASYNC_ADAPTER_TX_QUEUE_SIZE
+
+static void tx_timer_restart(struct uart_async_adapter_data *data, int32_t timeout)
+{
+	if (timeout == SYS_FOREVER_MS) {
+		k_timer_stop(&data->tx.timeout_timer);
+	} else {
+		k_timer_start(&data->tx.timeout_timer, SYS_TIMEOUT_MS(timeout), K_NO_WAIT);
+	}
+}
+
+/**
+ * @brief Replace the current TX buffer with the next queued one
+ *
+ * The lock must be held. The caller takes the event data of the current
+ * buffer before and restarts the timeout after releasing the lock.
+ *
+ * @param data    Adapter data
+ * @param timeout Timeout of the next buffer
+ *
+ * @return true if a queued buffer is now current, false if TX is idle
+ */
+static bool tx_advance(struct uart_async_adapter_data *data, int32_t *timeout)
+{
+	if (!data->tx.queue_count) {
+		data->tx.buf = NULL;
+		data->tx.curr_buf = NULL;
+		data->tx.size_left = 0;
+		return false;
+	}
+
+	data->tx.buf = data->tx.queue[data->tx.queue_head].buf;
+	data->tx.curr_buf = data->tx.buf;
+	data->tx.size_left = data->tx.queue[data->tx.queue_head].len;
+	*timeout = data->tx.queue[data->tx.queue_head].timeout;
+	data->tx.queue_head = (data->tx.queue_head + 1) % TX_QUEUE_SIZE;
+	data->tx.queue_count--;
+
+	return true;
+}
+
 static int tx(const struct device *dev, const uint8_t *buf, size_t len, int32_t timeout)
 {
 	int ret = 0;
@@ -152,8 +328,19 @@ static int tx(const struct device *dev, const uint8_t *buf, size_t len, int32_t
 	if (!len) {
 		LOG_DBG("%s: no data", __func__);
 	} else if (data->tx.buf) {
-		ret = -EBUSY;
-		LOG_DBG("%s: busy", __func__);
+		if (data->tx.queue_count < TX_QUEUE_SIZE) {
+			/* Chained by the interrupt handler when the current one is sent */
+			uint8_t idx = (data->tx.queue_head + data->tx.queue_count) % TX_QUEUE_SIZE;
+
+			data->tx.queue[idx].buf = buf;
+			data->tx.queue[idx].len = len;
+			data->tx.queue[idx].timeout = timeout;
+			data->tx.queue_count++;
+			LOG_DBG("%s: queued", __func__);
+		} else {
+			ret = -EBUSY;
+			LOG_DBG("%s: busy", __func__);
+		}
 	} else {
 		data->tx.buf = buf;
 		data->tx.curr_buf = buf;
@@ -174,11 +361,14 @@ static int tx(const struct device *dev, const uint8_t *buf, size_t len, int32_t
 	return ret;
 }
 
+/* Aborts the current buffer only, the queued ones are sent after it */
 static int tx_abort(const struct device *dev)
 {
 	int ret = 0;
 	struct uart_event event = {UART_TX_ABORTED};
 	struct uart_async_adapter_data *data = access_dev_data(dev);
+	bool more = false;
+	int32_t timeout;
 
 	data->tx.enabled = false;
 	k_timer_stop(&data->tx.timeout_timer);
@@ -192,14 +382,16 @@ static int tx_abort(const struct device *dev)
 		/* Set the event data */
 		event.data.tx.buf = data->tx.buf;
 		event.data.tx.len = data->tx.curr_buf - data->tx.buf;
-		/* Clear any pending tx */
-		data->tx.buf = NULL;
-		data->tx.curr_buf = NULL;
-		data->tx.size_left = 0;
+		more = tx_advance(data, &timeout);
+		data->tx.enabled = more;
 	}
 
 	k_spin_unlock(&(data->lock), key);
 
+	if (more) {
+		uart_irq_tx_enable(data->target);
+		tx_timer_restart(data, timeout);
+	}
 	if (!ret) {
 		user_callback(dev, &event);
 	}
@@ -212,6 +404,13 @@ static int rx_enable(const struct device *dev, uint8_t *buf, size_t len, int32_t
 	int ret = 0;
 	struct uart_async_adapter_data *data = access_dev_data(dev);
 
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+	/* The previous reception is still being disabled */
+	if (atomic_get(&data->rx.ring.disable)) {
+		return -EBUSY;
+	}
+#endif
+
 	k_spinlock_key_t key = k_spin_lock(&(data->lock));
 
 	if (data->rx.next_buf || data->rx.buf) {
@@ -223,6 +422,12 @@ static int rx_enable(const struct device *dev, uint8_t *buf, size_t len, int32_t
 	data->rx.next_buf = buf;
 	data->rx.next_buf_len = len;
 	data->rx.timeout = timeout;
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+	/* Reception is stopped, the interrupt handler does not use the ring */
+	atomic_set(&data->rx.ring.head, 0);
+	atomic_set(&data->rx.ring.tail, 0);
+	atomic_clear(&data->rx.ring.flush);
+#endif
 	data->rx.enabled = true;
 
 	k_spin_unlock(&(data->lock), key);
@@ -256,16 +461,36 @@ static int rx_disable(const struct device *dev)
 {
 	int ret = 0;
 	struct uart_async_adapter_data *data = access_dev_data(dev);
-	struct uart_event event_disabled = {UART_RX_DISABLED};
 
 	data->rx.enabled = false;
 	uart_irq_rx_disable(data->target);
 	uart_irq_err_disable(data->target);
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+	/* The consumer may be preempted or be the caller, and the interrupt
+	 * handler cannot wait for it: the consumer finishes the disable.
+	 */
+	if (k_is_in_isr() ||
+	    (k_current_get() == k_work_queue_thread_get(&rx_ring_workq))) {
+		atomic_set(&data->rx.ring.disable, 1);
+		rx_ring_submit(data);
+		return ret;
+	}
+
+	struct k_work_sync sync;
+
+	/* A disable that was left to the consumer is done here as well */
+	k_work_cancel_sync(&data->rx.ring.work, &sync);
+	atomic_clear(&data->rx.ring.disable);
+	rx_ring_disable(dev);
+#else
+	struct uart_event event_disabled = {UART_RX_DISABLED};
+
 	while (data->rx.buf || data->rx.next_buf) { //WRC test fix
 		switch_rx_buffer(dev, false);
 	}
 
 	user_callback(dev, &event_disabled);
+#endif
 
 	return ret;
 }
@@ -379,25 +604,55 @@ static int drv_cmd(const struct device *dev, uint32_t cmd, uint32_t p)
 
 static inline void on_tx_ready(const struct device *dev, struct uart_async_adapter_data *data)
 {
-	k_spinlock_key_t key = k_spin_lock(&(data->lock));
+	struct uart_event event = {UART_TX_DONE};
+	size_t pushed = 0;
+	bool chained;
+	int32_t timeout;
 
 	LOG_DBG("%s: Enter(%s) (left: %u)", __func__, dev->name, data->tx.size_left);
-	if (data->tx.size_left) {
-		__ASSERT_NO_MSG(data->tx.curr_buf);
-		int ret;
-
-		ret = uart_fifo_fill(data->target, data->tx.curr_buf, data->tx.size_left);
-		LOG_DBG("Pushed %d characters", ret);
-		if (ret <= 0) {
-			LOG_ERR("Unexpected fifo fill err: %d", ret);
-		} else {
+	do {
+		k_spinlock_key_t key = k_spin_lock(&(data->lock));
+
+		/* Fill the FIFO until it is full, not just once per interrupt */
+		while (data->tx.size_left) {
+			__ASSERT_NO_MSG(data->tx.curr_buf);
+			int ret;
+
+			ret = uart_fifo_fill(data->target, data->tx.curr_buf, data->tx.size_left);
+			if (ret < 0) {
+				LOG_ERR("Unexpected fifo fill err: %d", ret);
+				break;
+			}
+			if (!ret) {
+				break;
+			}
 			data->tx.curr_buf += ret;
 			data->tx.size_left -= ret;
+			STATS_BYTES_ADD(data, ret);
+			pushed += ret;
 		}
-	}
 
-	k_spin_unlock(&(data->lock), key);
+		/* The whole buffer is in the FIFO, so it is done and the next one
+		 * goes into the FIFO behind it with no gap on the line.
+		 */
+		chained = false;
+		if (!data->tx.size_left && data->tx.buf && data->tx.queue_count) {
+			event.data.tx.buf = data->tx.buf;
+			event.data.tx.len = data->tx.curr_buf - data->tx.buf;
+			chained = tx_advance(data, &timeout);
+		}
+
+		k_spin_unlock(&(data->lock), key);
 
+		if (chained) {
+			tx_timer_restart(data, timeout);
+			LOG_DBG("Notification: UART_TX_DONE (0x%x, size: %d)",
+				(unsigned int)event.data.tx.buf, event.data.tx.len);
+			user_callback(dev, &event);
+		}
+	} while (chained);
+
+	LOG_DBG("Pushed %u characters", pushed);
 	LOG_DBG("%s: Exit", __func__);
 }
 
@@ -406,6 +661,8 @@ static inline void on_tx_complete(const struct device *dev, struct uart_async_ad
 	LOG_DBG("%s: Enter(%s)", __func__, dev->name);
 	if (!data->tx.size_left) {
 		struct uart_event event = {UART_TX_DONE};
+		bool more = false;
+		int32_t timeout;
 
 		data->tx.enabled = false;
 		uart_irq_tx_disable(data->target);
@@ -418,14 +675,17 @@ static inline void on_tx_complete(const struct device *dev, struct uart_async_ad
 			/* Transfer really finished */
 			event.data.tx.buf = data->tx.buf;
 			event.data.tx.len = data->tx.curr_buf - data->tx.buf;
-			/* Clear any pending tx */
-			data->tx.buf = NULL;
-			data->tx.curr_buf = NULL;
-			data->tx.size_left = 0;
+			/* Continue with a buffer queued after the FIFO was filled */
+			more = tx_advance(data, &timeout);
+			data->tx.enabled = more;
 		}
 
 		k_spin_unlock(&(data->lock), key);
 
+		if (more) {
+			uart_irq_tx_enable(data->target);
+			tx_timer_restart(data, timeout);
+		}
 		if (event.data.tx.buf) {
 			LOG_DBG("Notification: UART_TX_DONE (0x%x, size: %d)",
 				(unsigned int)event.data.tx.buf, event.data.tx.len);
@@ -437,66 +697,150 @@ static inline void on_tx_complete(const struct device *dev, struct uart_async_ad
 	LOG_DBG("%s: Exit", __func__);
 }
 
-static inline void on_rx_ready(const struct device *dev, struct uart_async_adapter_data *data)
+/* Move the FIFO content into the current buffer, the lock must be held */
+static inline size_t rx_fifo_read(struct uart_async_adapter_data *data)
+{
+	size_t received = 0;
+	int ret;
+
+	while (data->rx.size_left) {
+		ret = uart_fifo_read(data->target, data->rx.curr_buf, data->rx.size_left);
+		if (ret < 0) {
+			LOG_ERR("Unexpected error on FIFO read: %d", ret);
+			break;
+		}
+		if (!ret) {
+			break;
+		}
+		__ASSERT_NO_MSG(data->rx.size_left >= ret);
+		data->rx.curr_buf += ret;
+		data->rx.size_left -= ret;
+		received += ret;
+	}
+
+	return received;
+}
+
+/* Empty the FIFO when there is no buffer, the lock must be held */
+static inline size_t rx_fifo_drop(struct uart_async_adapter_data *data)
 {
+	uint8_t dummy[RX_DROP_CHUNK];
+	size_t cnt = 0;
 	int ret;
+
+	do {
+		ret = uart_fifo_read(data->target, dummy, sizeof(dummy));
+		if (ret < 0) {
+			LOG_ERR("Unexpected error on FIFO dropping: %d", ret);
+			ret = 0;
+		}
+		cnt += ret;
+	} while (ret);
+
+	return cnt;
+}
+
+static inline void on_rx_ready(const struct device *dev, struct uart_async_adapter_data *data)
+{
 	bool notify_now = false;
+	bool buf_full;
+	size_t received;
+	size_t dropped = 0;
 
 	LOG_DBG("%s: Enter (%s)", __func__, dev->name);
 	if (data->rx.timeout != SYS_FOREVER_MS) {
 		k_timer_start(&data->rx.timeout_timer, SYS_TIMEOUT_MS(data->rx.timeout), K_NO_WAIT);
 	}
+	/* The lock is released only to hand a full buffer over to the user,
+	 * so there is one critical section per buffer and not per FIFO read.
+	 */
 	do {
 		k_spinlock_key_t key = k_spin_lock(&(data->lock));
 
-		if (!data->rx.size_left) {
-			notify_now = false;
+		received = 0;
+		if (data->rx.size_left) {
+			received = rx_fifo_read(data);
+		} else if (!data->rx.buf && !data->rx.next_buf) {
+			/* Data received without buffer - dropping */
+			dropped += rx_fifo_drop(data);
+		}
+		STATS_BYTES_ADD(data, received);
 
-			k_spin_unlock(&(data->lock), key);
+		buf_full = !data->rx.size_left && (data->rx.buf || data->rx.next_buf);
 
-			notify_rx_buffer(dev);
-			switch_rx_buffer(dev, true);
+		k_spin_unlock(&(data->lock), key);
 
-			key = k_spin_lock(&(data->lock));
+		LOG_DBG("Received %u characters", received);
+		if (received && (data->rx.timeout == 0)) {
+			notify_now = true;
 		}
-		if (!data->rx.size_left) {
-			/* Data received without buffer - dropping */
-			uint8_t dummy;
-			size_t cnt = 0;
-
-			do {
-				ret = uart_fifo_read(data->target, &dummy, 1);
-				if (ret < 0) {
-					LOG_ERR("Unexpected error on FIFO dropping: %d", ret);
-					ret = 0;
-				}
-				cnt += ret;
-			} while (ret);
-			LOG_ERR("Data received without buffer prepared, dropped %d bytes", cnt);
-		} else {
-			ret = uart_fifo_read(data->target, data->rx.curr_buf, data->rx.size_left);
-			LOG_DBG("Received %d characters", ret);
-			if (ret < 0) {
-				LOG_ERR("Unexpected error on FIFO read: %d", ret);
-				ret = 0;
-			}
-			__ASSERT_NO_MSG(data->rx.size_left >= ret);
-			data->rx.curr_buf += ret;
-			data->rx.size_left -= ret;
-			if (data->rx.timeout == 0) {
-				notify_now = true;
-			}
+		if (buf_full) {
+			notify_now = false;
+			notify_rx_buffer(dev);
+			switch_rx_buffer(dev, true);
 		}
+	} while (buf_full);
 
-		k_spin_unlock(&(data->lock), key);
-
-	} while (ret);
+	if (dropped) {
+		LOG_ERR("Data received without buffer prepared, dropped %u bytes", dropped);
+	}
 	if (notify_now) {
 		notify_rx_buffer(dev);
 	}
 	LOG_DBG("%s: Exit", __func__);
 }
 
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+static inline void on_rx_ready_ring(const struct device *dev,
+				    struct uart_async_adapter_data *data)
+{
+	/* Only this handler moves the head, the consumer only moves the tail */
+	atomic_val_t head = atomic_get(&data->rx.ring.head);
+	atomic_val_t tail = atomic_get(&data->rx.ring.tail);
+	size_t received = 0;
+	size_t dropped = 0;
+	size_t space;
+	size_t idx;
+	int ret;
+
+	LOG_DBG("%s: Enter (%s)", __func__, dev->name);
+	for (;;) {
+		space = RX_RING_SIZE - (size_t)(head - tail);
+		if (!space) {
+			/* The consumer is behind - dropping */
+			dropped = rx_fifo_drop(data);
+			break;
+		}
+		idx = head & RX_RING_MASK;
+		ret = uart_fifo_read(data->target, &data->rx.ring.buf[idx],
+				     MIN(space, RX_RING_SIZE - idx));
+		if (ret < 0) {
+			LOG_ERR("Unexpected error on FIFO read: %d", ret);
+			break;
+		}
+		if (!ret) {
+			break;
+		}
+		head += ret;
+		received += ret;
+	}
+	atomic_set(&data->rx.ring.head, head);
+	STATS_BYTES_ADD_LOCKED(data, received);
+
+	if (received) {
+		if (data->rx.timeout != SYS_FOREVER_MS) {
+			k_timer_start(&data->rx.timeout_timer, SYS_TIMEOUT_MS(data->rx.timeout),
+				      K_NO_WAIT);
+		}
+		rx_ring_submit(data);
+	}
+	if (dropped) {
+		LOG_ERR("RX ring full, dropped %u bytes", dropped);
+	}
+	LOG_DBG("%s: Exit", __func__);
+}
+#endif /* IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING) */
+
 static inline void on_error(const struct device *dev,
 			    struct uart_async_adapter_data *data,
 			    int rx_err)
@@ -507,7 +851,7 @@ static inline void on_error(const struct device *dev,
 	};
 
 	LOG_DBG("%s: Enter(%s)", __func__, dev->name);
-	rx_disable(data->target);
+	rx_disable(dev);
 	user_callback(dev, &event);
 	LOG_DBG("%s: Exit", __func__);
 }
@@ -519,6 +863,7 @@ static void uart_irq_handler(const struct device *target_dev, void *context)
 
 	__ASSERT(target_dev == data->target,
 		"IRQ handler called with a context that seems uninitialized.");
+	STATS_IRQ_ENTER(start);
 	LOG_DBG("irq_handler: Enter");
 	if (uart_irq_update(target_dev) && uart_irq_is_pending(target_dev)) {
 		if (data->tx.enabled && uart_irq_tx_ready(target_dev)) {
@@ -528,7 +873,11 @@ static void uart_irq_handler(const struct device *target_dev, void *context)
 			on_tx_complete(dev, data);
 		}
 		if (data->rx.enabled && uart_irq_rx_ready(target_dev)) {
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+			on_rx_ready_ring(dev, data);
+#else
 			on_rx_ready(dev, data);
+#endif
 		}
 
 		/* Check errors only after all the data is received from the device */
@@ -542,6 +891,7 @@ static void uart_irq_handler(const struct device *target_dev, void *context)
 		}
 	}
 	LOG_DBG("irq_handler: Exit");
+	STATS_IRQ_EXIT(data, start);
 }
 
 const struct uart_driver_api uart_async_adapter_driver_api = {
@@ -582,9 +932,32 @@ static void rx_timeout(struct k_timer *timer)
 {
 	const struct device *dev = k_timer_user_data_get(timer);
 
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+	struct uart_async_adapter_data *data = access_dev_data(dev);
+
+	/* Notify from the ring read position, in the consumer context */
+	atomic_set(&data->rx.ring.flush, 1);
+	rx_ring_submit(data);
+#else
 	notify_rx_buffer(dev);
+#endif
 }
 
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_STATS)
+void uart_async_adapter_stats_get(const struct device *dev,
+				  struct uart_async_adapter_stats *stats)
+{
+	struct uart_async_adapter_data *data = access_dev_data(dev);
+	/* The counters are only changed under this lock, see STATS_IRQ_EXIT() */
+	k_spinlock_key_t key = k_spin_lock(&(data->lock));
+
+	*stats = data->stats;
+	memset(&data->stats, 0, sizeof(data->stats));
+
+	k_spin_unlock(&(data->lock), key);
+}
+#endif /* IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_STATS) */
+
 void uart_async_adapter_init(const struct device *dev, const struct device *target)
 {
 	__ASSERT_NO_MSG(dev);
@@ -601,6 +974,23 @@ void uart_async_adapter_init(const struct device *dev, const struct device *targ
 	k_timer_user_data_set(&data->tx.timeout_timer, (void *)dev);
 	k_timer_init(&data->rx.timeout_timer, rx_timeout, NULL);
 	k_timer_user_data_set(&data->rx.timeout_timer, (void *)dev);
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+	static bool rx_ring_workq_started;
+
+	if (!rx_ring_workq_started) {
+		const struct k_work_queue_config cfg = {
+			.name = "uart_rx_ring",
+		};
+
+		k_work_queue_start(&rx_ring_workq, rx_ring_workq_stack,
+				   K_THREAD_STACK_SIZEOF(rx_ring_workq_stack),
+				   RX_RING_WORKQ_PRIORITY, &cfg);
+		rx_ring_workq_started = true;
+	}
+
+	data->rx.ring.dev = dev;
+	k_work_init(&data->rx.ring.work, rx_ring_work_handler);
+#endif
 
 	dev->state->initialized = true;
 }
@@ -22,7 +22,21 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
 
+/**
+ * @brief Interrupt time statistics of the adapter
+ *
+ * Used to compare the interrupt handler cost per transferred byte.
+ */
+struct uart_async_adapter_stats {
+	/** Cycles spent in the interrupt handler */
+	uint64_t cycles;
+	/** Bytes moved between the FIFO and the buffers */
+	uint64_t bytes;
+	/** Number of interrupts handled */
+	uint32_t irqs;
+};
 
 /**
  * @brief UART asynch adapter data structure
@@ -53,6 +67,19 @@ struct uart_async_adapter_data {
 		struct k_timer timeout_timer;
 		/** Tx state */
 		bool enabled;
+		/** Buffers sent after the current one, chained in the interrupt */
+		struct {
+			/** Buffer pointer */
+			const uint8_t *buf;
+			/** Buffer length */
+			size_t len;
+			/** Timeout requested for the buffer */
+			int32_t timeout;
+		} queue[CONFIG_BT_NUS_UART_ASYNC_ADAPTER_TX_QUEUE_SIZE];
+		/** Index of the oldest queued buffer */
+		uint8_t queue_head;
+		/** Number of queued buffers */
+		uint8_t queue_count;
 	} tx;
 
 	/** Data used for input transmission */
@@ -75,7 +102,33 @@ struct uart_async_adapter_data {
 		struct k_timer timeout_timer;
 		/** RX state */
 		bool enabled;
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING)
+		/** Ring filled by the interrupt handler and emptied in a work item */
+		struct {
+			/** Ring storage */
+			uint8_t buf[CONFIG_BT_NUS_UART_ASYNC_ADAPTER_RX_RING_SIZE];
+			/** Write position, updated only by the interrupt handler */
+			atomic_t head;
+			/** Read position, updated only by the consumer */
+			atomic_t tail;
+			/** The consumer has to notify the data it moved */
+			atomic_t flush;
+			/** The consumer has to finish a disable requested from
+			 *  the interrupt handler
+			 */
+			atomic_t disable;
+			/** Consumer moving the data into the user buffers */
+			struct k_work work;
+			/** The adapter device, used by the consumer */
+			const struct device *dev;
+		} ring;
+#endif
 	} rx;
+
+#if IS_ENABLED(CONFIG_BT_NUS_UART_ASYNC_ADAPTER_STATS)
+	/** Interrupt time statistics */
+	struct uart_async_adapter_stats stats;
+#endif
 };
 
 /**
@@ -123,4 +176,15 @@ extern const struct uart_driver_api uart_async_adapter_driver_api;
  */
 void uart_async_adapter_init(const struct device *dev, const struct device *target);
 
+/**
+ * @brief Get and reset the interrupt time statistics
+ *
+ * Available with CONFIG_BT_NUS_UART_ASYNC_ADAPTER_STATS.
+ *
+ * @param dev   The adapter interface
+ * @param stats Statistics collected since the previous call
+ */
+void uart_async_adapter_stats_get(const struct device *dev,
+				  struct uart_async_adapter_stats *stats);
+
 /** @} */
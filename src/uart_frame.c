@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) Multi-NUS Central contributors
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+/** @file
+ *  @brief Binary framing of the host UART stream
+ */
+
+#include <stdbool.h>
+
+#include "uart_frame.h"
+
+/* Longest COBS block: the code byte and 254 data bytes */
+#define COBS_BLOCK_MAX 0xFF
+
+size_t uart_frame_encode(uint8_t type, uint8_t addr, const uint8_t *payload,
+			 uint16_t len, uint8_t *dst)
+{
+	const uint8_t hdr[UART_FRAME_HDR_LEN] = {
+		type, addr, len & 0xFF, len >> 8
+	};
+	size_t code_pos = 0;
+	size_t out = 1;
+	uint8_t code = 1;
+
+	for (size_t i = 0; i < (UART_FRAME_HDR_LEN + len); i++) {
+		uint8_t byte = (i < UART_FRAME_HDR_LEN) ?
+			       hdr[i] : payload[i - UART_FRAME_HDR_LEN];
+
+		if (byte) {
+			dst[out++] = byte;
+			code++;
+		}
+
+		if (!byte || (code == COBS_BLOCK_MAX)) {
+			dst[code_pos] = code;
+			code_pos = out++;
+			code = 1;
+		}
+	}
+
+	dst[code_pos] = code;
+	dst[out++] = UART_FRAME_DELIMITER;
+
+	return out;
+}
+
+void uart_frame_decoder_reset(struct uart_frame_decoder *dec)
+{
+	dec->pos = 0;
+	dec->left = 0;
+	dec->zero_pending = false;
+	dec->overflow = false;
+}
+
+static void decoder_put(struct uart_frame_decoder *dec, uint8_t byte,
+			uint8_t *payload, size_t size)
+{
+	if (dec->pos < UART_FRAME_HDR_LEN) {
+		dec->hdr[dec->pos] = byte;
+	} else if ((dec->pos - UART_FRAME_HDR_LEN) < size) {
+		payload[dec->pos - UART_FRAME_HDR_LEN] = byte;
+	} else {
+		dec->overflow = true;
+		return;
+	}
+
+	dec->pos++;
+}
+
+enum uart_frame_status uart_frame_decode(struct uart_frame_decoder *dec,
+					 uint8_t byte, uint8_t *payload,
+					 size_t size)
+{
+	if (byte == UART_FRAME_DELIMITER) {
+		bool valid = !dec->overflow && !dec->left &&
+			     (dec->pos >= UART_FRAME_HDR_LEN) &&
+			     ((dec->pos - UART_FRAME_HDR_LEN) ==
+			      uart_frame_len_get(dec));
+
+		uart_frame_decoder_reset(dec);
+
+		return valid ? UART_FRAME_COMPLETE : UART_FRAME_INVALID;
+	}
+
+	if (dec->left) {
+		decoder_put(dec, byte, payload, size);
+		dec->left--;
+	} else {
+		/* A code byte: the zero that ended the previous block comes
+		 * first, then the data bytes of the new block.
+		 */
+		if (dec->zero_pending) {
+			decoder_put(dec, 0, payload, size);
+		}
+
+		dec->left = byte - 1;
+		dec->zero_pending = (byte < COBS_BLOCK_MAX);
+	}
+
+	return UART_FRAME_PENDING;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) Multi-NUS Central contributors
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+/** @file
+ *  @brief Binary framing of the host UART stream
+ */
+
+#ifndef UART_FRAME_H_
+#define UART_FRAME_H_
+
+/**
+ * @brief Binary framing of the host UART stream
+ * @defgroup uart_frame UART framing
+ * @{
+ *
+ * A frame is a header followed by the payload:
+ *
+ * | type (1) | address (1) | payload length (2, little endian) | payload |
+ *
+ * The frame is COBS encoded and ends with a zero byte, so any binary
+ * payload passes through and the receiver can resynchronize on the next
+ * zero byte. The address is the destination of the frames sent by the
+ * host and the source of the frames sent to the host.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Length of the frame header */
+#define UART_FRAME_HDR_LEN 4
+
+/** Byte that ends every encoded frame */
+#define UART_FRAME_DELIMITER 0x00
+
+/** Largest encoded frame, including the delimiter, for a payload length */
+#define UART_FRAME_ENCODED_MAX(len)					\
+	((len) + UART_FRAME_HDR_LEN + ((len) + UART_FRAME_HDR_LEN) / 254 + 3)
+
+/** Frame types */
+enum uart_frame_type {
+	/** Data routed to or received from a peer */
+	UART_FRAME_DATA = 0x00,
+	/** Command for the central, the payload is the command text */
+	UART_FRAME_COMMAND = 0x01,
+};
+
+/** State of a frame decoder */
+struct uart_frame_decoder {
+	uint8_t hdr[UART_FRAME_HDR_LEN];
+	/* Decoded bytes of the current frame */
+	size_t pos;
+	/* Data bytes left in the current COBS block */
+	uint8_t left;
+	/* A zero byte is owed at the end of the current COBS block */
+	bool zero_pending;
+	/* The frame did not fit in the payload buffer */
+	bool overflow;
+};
+
+/** Result of @ref uart_frame_decode */
+enum uart_frame_status {
+	/** The frame continues */
+	UART_FRAME_PENDING,
+	/** A complete frame was decoded */
+	UART_FRAME_COMPLETE,
+	/** The frame ended but it is not valid, it must be dropped */
+	UART_FRAME_INVALID,
+};
+
+/**
+ * @brief Encode a frame
+ *
+ * @param type    Frame type
+ * @param addr    Address field
+ * @param payload Payload
+ * @param len     Payload length
+ * @param dst     Output, at least UART_FRAME_ENCODED_MAX(len) bytes
+ *
+ * @return Length of the encoded frame, including the delimiter
+ */
+size_t uart_frame_encode(uint8_t type, uint8_t addr, const uint8_t *payload,
+			 uint16_t len, uint8_t *dst);
+
+/**
+ * @brief Reset a frame decoder to the start of a frame
+ *
+ * @param dec Decoder
+ */
+void uart_frame_decoder_reset(struct uart_frame_decoder *dec);
+
+/**
+ * @brief Decode the next byte of the stream
+ *
+ * The payload is written to the buffer as it is decoded. When the frame
+ * is complete, the header is available with @ref uart_frame_type_get,
+ * @ref uart_frame_addr_get and @ref uart_frame_len_get, and the decoder
+ * is ready for the next frame.
+ *
+ * @param dec     Decoder
+ * @param byte    Next byte of the stream
+ * @param payload Payload buffer
+ * @param size    Size of the payload buffer
+ *
+ * @return Status of the frame
+ */
+enum uart_frame_status uart_frame_decode(struct uart_frame_decoder *dec,
+					 uint8_t byte, uint8_t *payload,
+					 size_t size);
+
+static inline uint8_t uart_frame_type_get(const struct uart_frame_decoder *dec)
+{
+	return dec->hdr[0];
+}
+
+static inline uint8_t uart_frame_addr_get(const struct uart_frame_decoder *dec)
+{
+	return dec->hdr[1];
+}
+
+static inline uint16_t uart_frame_len_get(const struct uart_frame_decoder *dec)
+{
+	return dec->hdr[2] | (dec->hdr[3] << 8);
+}
+
+/** @} */
+
+#endif /* UART_FRAME_H_ */